@@ -0,0 +1,82 @@
+#ifndef E6E8D00C_B566_47A6_BFC2_0439C01738BE
+#define E6E8D00C_B566_47A6_BFC2_0439C01738BE
+
+#include <stddef.h>
+#include <new>
+#include <stdint.h>
+#include <string_view>
+#include <type_traits>
+#include <utility>
+
+namespace cjf
+{
+
+  /**
+   * @brief A fixed size bump allocator.
+   *
+   * Memory is carved sequentially out of a single buffer allocated up front and
+   * is only released in bulk by reset(). Destructors are never run, so only
+   * trivially destructible types may be constructed in the arena.
+   */
+  class arena
+  {
+  public:
+    arena(size_t capacity);
+    ~arena();
+
+    arena(const arena &) = delete;
+    arena &operator=(const arena &) = delete;
+
+    /**
+     * @brief Allocates size bytes with the given alignment.
+     *
+     * @return The allocated memory, or nullptr if the arena is exhausted.
+     */
+    void *allocate(size_t size, size_t align = alignof(max_align_t));
+
+    template <typename T>
+    T *allocate(size_t count = 1)
+    {
+      static_assert(std::is_trivially_destructible_v<T>, "arena never runs destructors");
+      return reinterpret_cast<T *>(allocate(sizeof(T) * count, alignof(T)));
+    }
+
+    template <typename T, typename... Args>
+    T *make(Args &&...args)
+    {
+      static_assert(std::is_trivially_destructible_v<T>, "arena never runs destructors");
+      void *mem = allocate(sizeof(T), alignof(T));
+      return mem ? new (mem) T(std::forward<Args>(args)...) : nullptr;
+    }
+
+    /**
+     * @brief Copies a string into the arena and null terminates it.
+     *
+     * @return The copy, or nullptr if the arena is exhausted.
+     */
+    char *strdup(std::string_view str);
+
+    /**
+     * @brief Formats a string into the arena as per snprintf.
+     *
+     * @return The formatted string, or nullptr if the arena is exhausted.
+     */
+    char *format(const char *fmt, ...) __attribute__((format(printf, 2, 3)));
+
+    void reset();
+
+    size_t capacity() const { return _capacity; }
+    size_t used() const { return _used; }
+    size_t available() const { return _capacity - _used; }
+    size_t high_water() const { return _high_water; }
+
+  private:
+    uint8_t *_buffer;
+    size_t _capacity;
+    size_t _used;
+    size_t _high_water;
+  };
+
+} // namespace cjf
+
+#endif /* E6E8D00C_B566_47A6_BFC2_0439C01738BE */
@@ -0,0 +1,133 @@
+#ifndef A0F7086F_DB19_4EC6_B3B4_DCB4E20C506E
+#define A0F7086F_DB19_4EC6_B3B4_DCB4E20C506E
+
+#include <esp_err.h>
+#include <esp_http_server.h>
+#include <esp_timer.h>
+#include <freertos/FreeRTOS.h>
+#include <memory>
+#include <stdint.h>
+
+namespace cjf
+{
+
+  struct connection_manager_config_t
+  {
+    // Keep-alive sockets idle for longer than this are closed. 0 disables reaping.
+    uint32_t idle_timeout_ms;
+    // Most sockets that may carry a streaming response at once. Streams beyond
+    // this are refused so that short requests always have sockets left.
+    size_t max_streams;
+    // Most idle keep-alive sockets to hold on to. 0 means no limit beyond
+    // keeping one socket free for the next connection.
+    size_t max_idle_sockets;
+  };
+
+  struct connection_stats_t
+  {
+    // Current state
+    uint32_t open;
+    uint32_t idle;
+    uint32_t active;
+    uint32_t streaming;
+    // Totals since the server was created
+    uint32_t opened;
+    uint32_t closed;
+    uint32_t evicted;
+    uint32_t reaped;
+    uint32_t refused_streams;
+    uint32_t requests;
+    uint32_t reused_requests;
+    // Fraction of requests that arrived on an already used connection
+    float reuse_ratio;
+  };
+
+  /**
+   * @brief Tracks the sockets httpd has open and closes the ones that are
+   * least useful before httpd runs out.
+   *
+   * Sockets that have been idle the longest are evicted first when the server
+   * is about to fill up. Sockets carrying a request, including long-lived
+   * streams and requests detached with httpd_req_async_handler_begin, are
+   * never evicted.
+   */
+  class connection_manager
+  {
+  public:
+    connection_manager(size_t max_sockets, const connection_manager_config_t &config);
+    ~connection_manager();
+
+    connection_manager(const connection_manager &) = delete;
+    connection_manager &operator=(const connection_manager &) = delete;
+
+    esp_err_t start(httpd_handle_t server);
+    /**
+     * @brief Stops reaping. Call before httpd_stop.
+     */
+    void stop();
+    /**
+     * @brief Forgets the server. Call once httpd_stop has returned, when no
+     * work queued for the reaper can run any more.
+     */
+    void detach();
+
+    esp_err_t on_open(int sockfd);
+    void on_close(int sockfd);
+
+    void request_started(int sockfd);
+    void request_finished(int sockfd);
+
+    /**
+     * @brief Marks the socket as carrying a streaming response until it closes.
+     *
+     * @return ESP_ERR_NO_MEM if the streaming quota is used up.
+     */
+    esp_err_t begin_stream(int sockfd);
+    /**
+     * @brief Gives up the streaming slot before the socket closes, for streams
+     * that failed to start.
+     */
+    void end_stream(int sockfd);
+
+    /**
+     * @brief Marks the socket as busy while a request detached from the httpd
+     * task is still responding on it. Every hold needs a matching release.
+     */
+    void hold(int sockfd);
+    void release(int sockfd);
+
+    connection_stats_t stats();
+
+  private:
+    struct session_t
+    {
+      int sockfd;
+      int64_t last_active;
+      uint32_t requests;
+      // Detached requests still responding on the socket
+      uint32_t held;
+      bool active;
+      bool streaming;
+      bool closing;
+    };
+
+    static bool is_idle(const session_t &session);
+    session_t *find(int sockfd);
+    bool evict_idle(int keep_sockfd);
+    void reap_idle();
+
+    static void reap_timer_callback(void *arg);
+    static void reap_work(void *arg);
+
+    const connection_manager_config_t _config;
+    const size_t _max_sockets;
+    std::unique_ptr<session_t[]> _sessions;
+    httpd_handle_t _server;
+    esp_timer_handle_t _reap_timer;
+    connection_stats_t _stats;
+    portMUX_TYPE _lock;
+  };
+
+} // namespace cjf
+
+#endif /* A0F7086F_DB19_4EC6_B3B4_DCB4E20C506E */
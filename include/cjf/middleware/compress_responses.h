@@ -0,0 +1,85 @@
+#ifndef B284E39F_EA43_491E_9541_755D12857D64
+#define B284E39F_EA43_491E_9541_755D12857D64
+
+#include "../web_server.h"
+#include <freertos/FreeRTOS.h>
+#include <stdint.h>
+
+struct z_stream_s;
+
+namespace cjf
+{
+
+  extern const char *const COMPRESS_RESPONSES_DEFAULT_MIME_TYPES[];
+
+  struct compress_responses_config_t
+  {
+    // Bodies smaller than this are sent uncompressed
+    size_t min_size = 512;
+    // nullptr terminated list of content types to compress
+    const char *const *mime_types = COMPRESS_RESPONSES_DEFAULT_MIME_TYPES;
+    // zlib compression level, 1 (fastest) to 9 (smallest)
+    int level = 6;
+    // log2 of the window size, 9 to 15. Small windows need far less memory.
+    int window_bits = 10;
+    // zlib memLevel, 1 to 9
+    int mem_level = 4;
+    // Size of the buffer compressed output is collected in before it is sent
+    size_t output_size = 1024;
+  };
+
+  struct compress_responses_stats_t
+  {
+    // Responses to clients accepting gzip that were compressed
+    uint32_t compressed;
+    // Responses to clients accepting gzip that were too small, had a type
+    // outside the allowlist or arrived while the compressor was busy
+    uint32_t skipped;
+    // Bytes before and after compression, bytes_in - bytes_out were saved
+    uint64_t bytes_in;
+    uint64_t bytes_out;
+  };
+
+  /**
+   * @brief Gzips responses sent downstream with the cjf::resp_* functions.
+   *
+   * Responses are compressed when the client accepts gzip, the content type
+   * set with resp_set_type is in the allowlist and the body is at least
+   * min_size bytes. Responses without a type set that way are left alone.
+   *
+   * The compressor state is allocated once in a fixed pool when the middleware
+   * is constructed and reset between responses, so compressing never touches
+   * the heap.
+   */
+  class compress_responses : public middleware_t
+  {
+  public:
+    static constexpr const char* name = "compress_responses";
+
+    compress_responses(const compress_responses_config_t &config = {});
+    ~compress_responses();
+
+    compress_responses_stats_t stats();
+
+  private:
+    class writer;
+
+    const compress_responses_config_t _config;
+    uint8_t *_pool;
+    size_t _pool_size;
+    size_t _pool_used;
+    z_stream_s *_stream;
+    char *_pending;
+    char *_output;
+    bool _busy;
+    compress_responses_stats_t _stats;
+    portMUX_TYPE _stats_lock;
+
+    static void *pool_alloc(void *opaque, unsigned int items, unsigned int size);
+    static void pool_free(void *opaque, void *address);
+    static esp_err_t compress_responses_handler(httpd_req_t *req, middleware_next_t next);
+  };
+
+} // namespace cjf
+
+#endif /* B284E39F_EA43_491E_9541_755D12857D64 */
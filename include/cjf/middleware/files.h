@@ -13,6 +13,8 @@ namespace cjf
     size_t max_path_size;
     const char *index_filename;
     const char *cache_control;
+    // Largest chunk read at a time. Chunks come from the request arena, so
+    // they are also capped by what is left of web_server_config_t::arena_size.
     size_t chunk_size;
   };
 
@@ -0,0 +1,73 @@
+#ifndef EAEE6D39_922E_4BE6_BBE6_44FB524EC4EC
+#define EAEE6D39_922E_4BE6_BBE6_44FB524EC4EC
+
+#include <cjf/web_server.h>
+#include <cjf/middleware/mjpeg_stream.h>
+#include <freertos/FreeRTOS.h>
+#include <freertos/task.h>
+#include <memory>
+
+namespace cjf
+{
+
+  struct mjpeg_snapshot_config_t
+  {
+    const char *cache_control = "no-cache";
+    // How long a client that already has the latest frame (or that arrives
+    // before the first frame) waits for the next one. 0 disables long polling.
+    TickType_t long_poll_ticks = 0;
+    // Most clients that may wait at once. Others are answered straight away.
+    size_t max_long_polls = 4;
+    // Waiting requests are answered from a task of their own so that httpd
+    // keeps serving other requests in the meantime.
+    uint32_t task_stack_size = 4096;
+    UBaseType_t task_priority = 5;
+  };
+
+  /**
+   * @brief Serves the latest frame written to an mjpeg_stream as a single JPEG.
+   *
+   * Snapshots never trigger a capture. Each response carries an ETag derived
+   * from the stream's id and the frame's sequence number, and a request whose
+   * If-None-Match names the latest frame receives 304 Not Modified.
+   *
+   * Constructing a snapshot makes the stream keep its latest frame, which
+   * needs a camera with at least two frame buffers.
+   */
+  class mjpeg_snapshot : public middleware_t
+  {
+  public:
+    static constexpr const char* name = "mjpeg_snapshot";
+
+    mjpeg_snapshot(mjpeg_stream &stream, const mjpeg_snapshot_config_t &config = {});
+    ~mjpeg_snapshot();
+
+  private:
+    struct long_poll_t
+    {
+      httpd_req_t *req;
+      // The latest frame when the request arrived, 0 if there was none
+      uint32_t sequence;
+      TickType_t start;
+    };
+
+    esp_err_t respond(httpd_req_t *req, const std::shared_ptr<camera_fb_t> &frame, const char *etag,
+                      bool not_modified);
+    esp_err_t start_long_poll(httpd_req_t *req, uint32_t sequence);
+    size_t long_poll_count();
+    TickType_t finish_long_polls();
+    void finish_long_poll(size_t index, const std::shared_ptr<camera_fb_t> &frame, uint32_t sequence);
+    static void long_poll_task(void *arg);
+
+    mjpeg_stream &_stream;
+    const mjpeg_snapshot_config_t _config;
+    std::unique_ptr<long_poll_t[]> _long_polls;
+    size_t _long_poll_count;
+    portMUX_TYPE _long_polls_lock;
+    TaskHandle_t _task;
+    static esp_err_t mjpeg_snapshot_handler(httpd_req_t *req, middleware_next_t next);
+  };
+
+} // namespace cjf
+
+#endif /* EAEE6D39_922E_4BE6_BBE6_44FB524EC4EC */
@@ -6,6 +6,7 @@
 #include <esp_camera.h>
 #include <memory>
 #include <freertos/event_groups.h>
+#include <freertos/semphr.h>
 #include <string>
 
 namespace cjf
@@ -19,6 +20,9 @@ namespace cjf
     void (*on_stream_start)(void *ctx) = NULL;
     void (*on_stream_end)(void *ctx) = NULL;
     void *ctx = NULL;
+    size_t max_subscribers = 4;
+    uint32_t task_stack_size = 4096;
+    UBaseType_t task_priority = 5;
   };
 
   class mjpeg_stream : public multipart_stream
@@ -27,8 +31,60 @@ namespace cjf
     static constexpr const char* name = "mjpeg_stream";
 
     mjpeg_stream(const mjpeg_stream_config_t& config);
+    ~mjpeg_stream();
 
-    void write(std::shared_ptr<camera_fb_t> frame);
+    /**
+     * @brief Sends a frame to the stream and makes it the latest frame.
+     *
+     * The stream holds on to frame until it has been sent, even if the write
+     * times out first. Once keep_latest_frame has been called, the frame is
+     * also kept alive until the next write so that it can be served as a
+     * snapshot.
+     */
+    esp_err_t write(std::shared_ptr<camera_fb_t> frame, TickType_t ticks_to_wait = portMAX_DELAY);
+
+    /**
+     * @brief Keeps the most recently written frame for latest_frame.
+     *
+     * mjpeg_snapshot calls this when it is constructed. Holding on to a frame
+     * ties up a camera frame buffer, so cameras need at least two of them
+     * (fb_count >= 2) once this is enabled.
+     */
+    void keep_latest_frame();
+
+    /**
+     * @brief Returns the most recently written frame, or nullptr unless
+     * keep_latest_frame has been called.
+     *
+     * @param sequence Receives the frame's sequence number, which starts at 1
+     * and increases with every write. 0 means no frame has been written.
+     */
+    std::shared_ptr<camera_fb_t> latest_frame(uint32_t *sequence);
+
+    /**
+     * @brief Waits until a frame newer than sequence has been written.
+     *
+     * @return ESP_ERR_TIMEOUT if no newer frame was written in time.
+     */
+    esp_err_t wait_for_frame(uint32_t sequence, TickType_t ticks_to_wait);
+
+    /**
+     * @brief A random number picked when the stream is created.
+     *
+     * Sequence numbers start over after a reboot, so anything that identifies
+     * a frame to clients, such as an ETag, should include this as well.
+     */
+    uint32_t stream_id() const { return _stream_id; }
+
+  private:
+    static void release_frame(void *ctx);
+
+    SemaphoreHandle_t _frame_lock;
+    EventGroupHandle_t _frame_events;
+    std::shared_ptr<camera_fb_t> _frame;
+    const uint32_t _stream_id;
+    uint32_t _frame_sequence;
+    bool _keep_latest_frame;
   };
 
 } // namespace cjf
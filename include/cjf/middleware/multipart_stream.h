@@ -2,7 +2,10 @@
 #define DF8FF9A8_57E9_4DA8_AE65_9BA987CAF2E0
 
 #include "../web_server.h"
+#include <freertos/FreeRTOS.h>
 #include <freertos/event_groups.h>
+#include <freertos/task.h>
+#include <memory>
 #include <string>
 
 namespace cjf
@@ -17,8 +20,22 @@ namespace cjf
     void (*on_stream_start)(void *ctx) = NULL;
     void (*on_stream_end)(void *ctx) = NULL;
     void *ctx = NULL;
+    // Most clients that may watch the stream at once
+    size_t max_subscribers = 4;
+    // Parts are sent from a task of their own so that httpd keeps serving
+    // other requests while clients are watching.
+    uint32_t task_stack_size = 4096;
+    UBaseType_t task_priority = 5;
   };
 
+  /**
+   * @brief Streams parts written from any task to every subscribed client.
+   *
+   * Requests are detached from httpd with req_async_handler_begin and
+   * handed to a sender task, so the httpd task is free as soon as a client
+   * subscribes. on_stream_start runs on the httpd task and on_stream_end on the
+   * sender task.
+   */
   class multipart_stream : public middleware_t
   {
 
@@ -28,6 +45,13 @@ namespace cjf
     multipart_stream(const multipart_stream_config_t& config);
     ~multipart_stream();
 
+    /**
+     * @brief Sends a part to every subscriber and waits until it has been sent.
+     *
+     * Returns immediately when nobody is subscribed, so producers such as a
+     * camera loop never stall on an empty stream. If the write times out the
+     * part may still be in flight, so data must outlive the next write.
+     */
     esp_err_t write(const char *data, const size_t size, TickType_t ticks_to_wait = portMAX_DELAY);
     esp_err_t write(const uint8_t *data, const size_t size, TickType_t ticks_to_wait = portMAX_DELAY);
     static esp_err_t multipart_stream_handler(httpd_req_t *req, middleware_next_t next);
@@ -35,15 +59,39 @@ namespace cjf
   protected:
     multipart_stream(const char* name, const multipart_stream_config_t config);
 
+    /**
+     * @brief Sends a part whose data is released by the stream once it is done
+     * with it.
+     *
+     * release(release_ctx) is called exactly once: by the sender task after
+     * the part has been sent, even if the write timed out in the meantime, or
+     * straight away if the part is never handed to the sender.
+     */
+    esp_err_t write(const char *data, const size_t size, void (*release)(void *ctx), void *release_ctx,
+                    TickType_t ticks_to_wait);
+
   private:
+    size_t subscriber_count();
+    void send_part();
+    void remove_subscriber(size_t index);
+    static void sender_task(void *arg);
+
     const multipart_stream_config_t _config;
     EventGroupHandle_t _event_group;
     const char *_part;
+    void (*_part_release)(void *ctx);
+    void *_part_release_ctx;
     const std::string _part_boundary;
     const std::string _part_content_type;
     ssize_t _part_size;
     int64_t _send_time;
     const std::string _stream_content_type;
+    std::unique_ptr<char[]> _part_headers;
+    size_t _part_headers_size;
+    std::unique_ptr<httpd_req_t *[]> _subscribers;
+    size_t _subscriber_count;
+    portMUX_TYPE _subscribers_lock;
+    TaskHandle_t _task;
   };
 
 } // namespace cjf
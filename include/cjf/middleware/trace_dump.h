@@ -0,0 +1,31 @@
+#ifndef D7B3F2A8_1C6E_4B9D_8F05_6A2E9C4D13B7
+#define D7B3F2A8_1C6E_4B9D_8F05_6A2E9C4D13B7
+
+#include "../web_server.h"
+
+namespace cjf
+{
+
+  /**
+   * @brief Responds with the server's recent request traces as JSON.
+   *
+   * Tracing is enabled with web_server_config_t::trace_depth. Traces are
+   * listed oldest first, and each middleware hop reports when it started
+   * relative to the request, its total time and its time excluding the
+   * middleware it called. Mount it on a debug path.
+   */
+  class trace_dump : public middleware_t
+  {
+  public:
+    static constexpr const char* name = "trace_dump";
+
+    trace_dump(web_server &server);
+
+  private:
+    web_server &_server;
+    static esp_err_t trace_dump_handler(httpd_req_t *req, middleware_next_t next);
+  };
+
+} // namespace cjf
+
+#endif /* D7B3F2A8_1C6E_4B9D_8F05_6A2E9C4D13B7 */
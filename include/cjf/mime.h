@@ -3,6 +3,7 @@
 
 #include <esp_http_server.h>
 #include <string>
+#include <string_view>
 
 namespace cjf
 {
@@ -12,8 +13,8 @@ extern const char *MIME_UNKNOWN;
 void mime_register(const char *mime, const char *file_extension);
 void mime_register(const std::string &mime, const std::string &file_extension);
 
-const char *mime_from_path(const std::string path);
-esp_err_t set_content_type_from_path(httpd_req_t *req, const std::string path);
+const char *mime_from_path(std::string_view path);
+esp_err_t set_content_type_from_path(httpd_req_t *req, std::string_view path);
 
 } // namespace cjf
 
@@ -0,0 +1,230 @@
+#ifndef F5B607EF_E9A6_4758_8EA0_E02926DD1661
+#define F5B607EF_E9A6_4758_8EA0_E02926DD1661
+
+#include "arena.h"
+#include "uri.h"
+#include <esp_err.h>
+#include <esp_http_server.h>
+#include <memory>
+#include <optional>
+#include <string_view>
+
+namespace cjf
+{
+
+  class web_server;
+
+  /**
+   * @brief Receives response bodies sent with the cjf::resp_* functions.
+   *
+   * Middleware can install a writer to transform the output of everything
+   * downstream of it. A writer passes its output on to the writer that was
+   * installed before it, which is nullptr for httpd itself.
+   */
+  class response_writer
+  {
+  public:
+    virtual ~response_writer() = default;
+
+    virtual esp_err_t send(httpd_req_t *req, const char *buf, size_t len) = 0;
+
+    // A zero length chunk ends the response
+    virtual esp_err_t send_chunk(httpd_req_t *req, const char *buf, size_t len) = 0;
+
+    static esp_err_t forward_send(response_writer *next, httpd_req_t *req, const char *buf, size_t len);
+    static esp_err_t forward_send_chunk(response_writer *next, httpd_req_t *req, const char *buf, size_t len);
+  };
+
+  struct request_slot_t
+  {
+    const char *key;
+    void *value;
+  };
+
+  /**
+   * @brief State for the request currently being dispatched by a web_server.
+   *
+   * The context lives for the lifetime of the server and is recycled between
+   * requests, so anything obtained from it (scratch memory, slot values, the
+   * path, parameters) is only valid until the request completes.
+   *
+   * Views returned by the URI accessors point into req->uri unless the value
+   * had to be percent-decoded, in which case the decoded copy lives in the
+   * request arena. Decoding happens on first access and is cached.
+   */
+  class request_context
+  {
+  public:
+    /**
+     * @brief Returns the context for a request dispatched by a web_server.
+     *
+     * @return The context, or nullptr if the request is not being handled by
+     * a web_server.
+     */
+    static request_context *from(httpd_req_t *req);
+
+    web_server *server() const { return _server; }
+    httpd_req_t *req() const { return _req; }
+
+    /**
+     * @brief The ctx of the middleware that is currently running.
+     */
+    void *ctx() const { return _ctx; }
+
+    /**
+     * @brief The request URI without the query string or fragment.
+     */
+    std::string_view path() const { return _path; }
+
+    /**
+     * @brief The percent-decoded path.
+     */
+    std::string_view decoded_path();
+
+    /**
+     * @brief The raw query string, without the leading '?'.
+     */
+    std::string_view query_string() const { return _query_string; }
+
+    /**
+     * @brief Returns a parameter captured by the running middleware's route.
+     *
+     * For a route of "/api/devices/:id", param("id") is the matched segment.
+     * A trailing '*' in the route is captured as param("*").
+     *
+     * @return The decoded value, or an empty view if there is no such parameter.
+     */
+    std::string_view param(std::string_view name);
+
+    /**
+     * @brief Returns the decoded value of the first query parameter named key.
+     *
+     * The query string is parsed on first use. A parameter without a value
+     * ("?flag") returns an empty view.
+     */
+    std::optional<std::string_view> query(std::string_view key);
+
+    size_t query_count();
+
+    /**
+     * @brief Returns the query parameter at index with its key and value decoded.
+     */
+    const uri_param_t &query_at(size_t index);
+
+    /**
+     * @brief The type most recently set with resp_set_type, or nullptr.
+     */
+    const char *content_type() const { return _content_type; }
+
+    /**
+     * @brief True once any part of the body has been sent with the resp_* functions.
+     */
+    bool response_started() const { return _response_started; }
+
+    response_writer *writer() const { return _writer; }
+
+    /**
+     * @brief Routes downstream output through writer.
+     *
+     * @return The previously installed writer, to be restored once downstream
+     * middleware returns.
+     */
+    response_writer *set_writer(response_writer *writer);
+
+    /**
+     * @brief Claims one of the server's streaming slots for this request's socket.
+     *
+     * Middleware that hold the socket for a long-lived response should call this
+     * first. The slot is released when the socket closes, so streams handed to
+     * another task keep it. Detach them with req_async_handler_begin rather
+     * than httpd_req_async_handler_begin, otherwise the socket looks idle to
+     * the connection manager once the handler returns.
+     *
+     * @return ESP_ERR_NO_MEM if max_streams streams are already open.
+     */
+    esp_err_t begin_stream();
+
+    /**
+     * @brief Gives the streaming slot back early, for a stream that failed to start.
+     */
+    void end_stream();
+
+    /**
+     * @brief Scratch memory that is released when the request completes.
+     */
+    arena &scratch() { return _arena; }
+
+    /**
+     * @brief Stores a value for later middleware in the chain.
+     *
+     * Keys are compared by pointer first, so using the same string constant for
+     * set and get is cheapest.
+     *
+     * @return ESP_ERR_NO_MEM if all slots are in use.
+     */
+    esp_err_t set(const char *key, void *value);
+
+    void *get(const char *key) const;
+
+    template <typename T>
+    T *get(const char *key) const
+    {
+      return reinterpret_cast<T *>(get(key));
+    }
+
+  private:
+    friend class web_server;
+    friend esp_err_t resp_set_type(httpd_req_t *req, const char *type);
+    friend esp_err_t resp_send(httpd_req_t *req, const char *buf, ssize_t len);
+    friend esp_err_t resp_send_chunk(httpd_req_t *req, const char *buf, ssize_t len);
+
+    // The part of the context that belongs to a single middleware in the chain
+    struct hop_t
+    {
+      void *ctx;
+      uri_param_t *params;
+      size_t param_count;
+    };
+
+    request_context(web_server *server, size_t arena_size, size_t max_slots,
+                    size_t max_params, size_t max_query_params);
+
+    void begin(httpd_req_t *req);
+    void end();
+    void start_response();
+
+    bool match(const char *uri_template);
+    hop_t enter(void *ctx);
+    void leave(const hop_t &hop);
+
+    std::string_view decode(std::string_view str, bool plus_as_space);
+    void parse_query();
+
+    web_server *_server;
+    httpd_req_t *_req;
+    void *_ctx;
+    std::string_view _path;
+    std::string_view _decoded_path;
+    bool _path_decoded;
+    std::string_view _query_string;
+    const char *_content_type;
+    bool _response_started;
+    response_writer *_writer;
+    arena _arena;
+    std::unique_ptr<request_slot_t[]> _slots;
+    size_t _max_slots;
+    size_t _slot_count;
+    uri_param_t *_params;
+    size_t _param_count;
+    std::unique_ptr<uri_param_t[]> _matched;
+    size_t _max_params;
+    size_t _matched_count;
+    std::unique_ptr<uri_param_t[]> _query;
+    size_t _max_query_params;
+    size_t _query_count;
+    bool _query_parsed;
+  };
+
+} // namespace cjf
+
+#endif /* F5B607EF_E9A6_4758_8EA0_E02926DD1661 */
@@ -0,0 +1,61 @@
+#ifndef C1E5A0B2_7D4F_4F3A_9E62_3B8D5C7A41F9
+#define C1E5A0B2_7D4F_4F3A_9E62_3B8D5C7A41F9
+
+#include <esp_err.h>
+#include <esp_http_server.h>
+#include <stdint.h>
+
+namespace cjf
+{
+
+  // Middleware deeper in the chain than this are counted towards the last
+  // recorded one.
+  constexpr size_t REQUEST_TRACE_MAX_HOPS = 8;
+  // Longer paths are truncated.
+  constexpr size_t REQUEST_TRACE_URI_SIZE = 64;
+
+  struct trace_hop_t
+  {
+    const char *name;
+    // Times from esp_timer_get_time. exit_us is 0 while the middleware runs.
+    int64_t enter_us;
+    int64_t exit_us;
+    esp_err_t result;
+  };
+
+  struct request_trace_t
+  {
+    char uri[REQUEST_TRACE_URI_SIZE];
+    httpd_method_t method;
+    int64_t start_us;
+    int64_t end_us;
+    esp_err_t result;
+    // Set once the chain went deeper than REQUEST_TRACE_MAX_HOPS
+    bool truncated;
+    size_t hop_count;
+    trace_hop_t hops[REQUEST_TRACE_MAX_HOPS];
+
+    /**
+     * @brief Time spent in a middleware itself, excluding the middleware it
+     * called through next.
+     *
+     * Each hop runs inside the previous one's next, so this is its own time
+     * minus the time of the hop after it. Hops that are still running are
+     * measured up to now.
+     */
+    int64_t self_us(size_t index, int64_t now) const
+    {
+      auto &hop = hops[index];
+      int64_t total = (hop.exit_us ? hop.exit_us : now) - hop.enter_us;
+      if (index + 1 < hop_count)
+      {
+        auto &inner = hops[index + 1];
+        total -= (inner.exit_us ? inner.exit_us : now) - inner.enter_us;
+      }
+      return total;
+    }
+  };
+
+} // namespace cjf
+
+#endif /* C1E5A0B2_7D4F_4F3A_9E62_3B8D5C7A41F9 */
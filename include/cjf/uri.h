@@ -0,0 +1,73 @@
+#ifndef DB267213_EF57_4274_A7FD_2443007ED934
+#define DB267213_EF57_4274_A7FD_2443007ED934
+
+#include <stddef.h>
+#include <string_view>
+
+namespace cjf
+{
+
+  /**
+   * @brief A key/value pair taken from a URI.
+   *
+   * Both views point into the original URI until they are decoded. The
+   * encoded flags record whether percent-decoding would change them.
+   */
+  struct uri_param_t
+  {
+    std::string_view key;
+    std::string_view value;
+    bool encoded_key;
+    bool encoded_value;
+  };
+
+  /**
+   * @brief Matches a path against a route template.
+   *
+   * Templates are compatible with httpd_uri_match_wildcard and additionally
+   * support named segments:
+   *  - ":name" at the start of a segment captures that segment
+   *  - a trailing '*' matches (and captures as "*") the rest of the path
+   *  - '?' at the end of the template makes the preceding character optional,
+   *    and "x?*" or "x*?" also matches anything after it
+   *
+   * @param uri_template The route template, e.g. "/api/devices/:id".
+   * @param path The undecoded request path without the query string.
+   * @param params Receives the captured parameters.
+   * @param max_params The capacity of params.
+   * @param param_count Receives the number of captured parameters.
+   * @return true if the path matches.
+   */
+  bool uri_template_match(std::string_view uri_template, std::string_view path,
+                          uri_param_t *params, size_t max_params, size_t *param_count);
+
+  /**
+   * @brief Counts the named parameters a route template captures.
+   */
+  size_t uri_template_param_count(std::string_view uri_template);
+
+  /**
+   * @brief Splits a query string into key/value pairs in a single pass.
+   *
+   * Pairs beyond max_params are ignored.
+   *
+   * @return The number of pairs written to params.
+   */
+  size_t uri_parse_query(std::string_view query, uri_param_t *params, size_t max_params);
+
+  /**
+   * @brief Returns true if uri_decode would change the string.
+   */
+  bool uri_is_encoded(std::string_view str, bool plus_as_space);
+
+  /**
+   * @brief Percent-decodes a string. Malformed escapes are copied unchanged.
+   *
+   * @param out A buffer of at least str.size() bytes. May alias str.
+   * @return The number of bytes written to out.
+   */
+  size_t uri_decode(std::string_view str, char *out, bool plus_as_space);
+
+} // namespace cjf
+
+#endif /* DB267213_EF57_4274_A7FD_2443007ED934 */
@@ -1,11 +1,16 @@
 #ifndef AD824137_C7F6_45DB_A47C_B47B987273BA
 #define AD824137_C7F6_45DB_A47C_B47B987273BA
 
+#include "connection_manager.h"
+#include "request_context.h"
+#include "request_trace.h"
 #include <cJSON.h>
 #include <esp_http_server.h>
 #include <esp_err.h>
+#include <freertos/FreeRTOS.h>
 #include <functional>
 #include <list>
+#include <memory>
 #include <stdint.h>
 #include <string>
 
@@ -29,12 +34,54 @@ namespace cjf
     middleware_t middleware;
   };
 
+  struct web_server_config_t
+  {
+    // Size of the per-request scratch arena. The server handles one request at
+    // a time, so this is allocated once when the server is constructed.
+    size_t arena_size = 2048;
+    // Number of key/value slots middleware can use to share data per request.
+    size_t max_request_slots = 8;
+    // Most parameters a single route template may capture.
+    size_t max_route_params = 4;
+    // Query parameters beyond this are ignored.
+    size_t max_query_params = 8;
+    // Track sockets through httpd's open_fn and close_fn to reap and evict
+    // idle ones and enforce max_streams. This replaces httpd's own LRU purge.
+    // The settings below only apply when it is enabled.
+    bool manage_connections = true;
+    // Idle keep-alive sockets are closed after this long. 0 leaves them open
+    // until httpd needs the socket for a new connection.
+    uint32_t idle_timeout_ms = 15000;
+    // Most sockets that may carry a streaming response, e.g. MJPEG, at once.
+    size_t max_streams = 2;
+    // Most idle keep-alive sockets to hold on to. 0 only keeps one socket free.
+    size_t max_idle_sockets = 0;
+    // Number of recent requests whose middleware timings are kept, e.g. for
+    // trace_dump. 0 disables tracing.
+    size_t trace_depth = 0;
+    // When tracing, also report the timings to clients in a Server-Timing
+    // header on responses sent with the resp_* functions.
+    bool server_timing = true;
+  };
+
+  /**
+   * @brief Runs a chain of middleware for every request httpd receives.
+   *
+   * The server takes over httpd's global_user_ctx to find itself from a
+   * request, so httpd_get_global_user_ctx returns the web_server. A context
+   * set in the httpd_config_t is available from global_user_ctx() instead and
+   * is released on stop with its global_user_ctx_free_fn, or free() if none
+   * was set, as httpd would.
+   */
   class web_server
   {
   public:
-    web_server(const httpd_config_t &config = HTTPD_DEFAULT_CONFIG());
+    web_server(const httpd_config_t &config = HTTPD_DEFAULT_CONFIG(), const web_server_config_t &options = {});
     ~web_server();
 
+    web_server(const web_server &) = delete;
+    web_server &operator=(const web_server &) = delete;
+
     esp_err_t start();
     esp_err_t stop();
 
@@ -43,17 +90,83 @@ namespace cjf
     void use(const char *path, middleware_t middleware);
     void use(const char *path, middleware_handler_t handler);
 
+    /**
+     * @brief The global_user_ctx passed in the httpd_config_t.
+     */
+    void *global_user_ctx() const { return _global_user_ctx; }
+
+    connection_stats_t connection_stats();
+
+    /**
+     * @brief Number of completed request traces held, at most trace_depth.
+     */
+    size_t trace_count();
+
+    /**
+     * @brief Copies a completed request trace, 0 being the oldest.
+     *
+     * @return false if index is out of range.
+     */
+    bool trace_at(size_t index, request_trace_t &trace);
+
   private:
+    friend class request_context;
+    friend esp_err_t req_async_handler_begin(httpd_req_t *req, httpd_req_t **async_req);
+    friend esp_err_t req_async_handler_complete(httpd_req_t *req);
+
     httpd_config_t _config;
+    const web_server_config_t _options;
     std::list<middleware_uri_t> _routes;
     httpd_handle_t _server;
+    request_context _context;
+    connection_manager _connections;
+    httpd_open_func_t _open_fn;
+    httpd_close_func_t _close_fn;
+    void *_global_user_ctx;
+    httpd_free_ctx_fn_t _global_user_ctx_free_fn;
+    std::unique_ptr<request_trace_t[]> _traces;
+    size_t _trace_count;
+    size_t _trace_next;
+    request_trace_t _trace;
+    portMUX_TYPE _trace_lock;
 
     esp_err_t _register_handler_for_method(const httpd_method_t method);
 
+    void _trace_begin(httpd_req_t *req);
+    void _trace_end(esp_err_t result);
+    int _trace_enter(const char *name);
+    void _trace_exit(int hop, esp_err_t result);
+    void _trace_server_timing(httpd_req_t *req);
+
     static esp_err_t _req_handler(httpd_req_t *req);
+    static void _free_global_user_ctx(void *ctx);
+    static esp_err_t _on_open(httpd_handle_t hd, int sockfd);
+    static void _on_close(httpd_handle_t hd, int sockfd);
     static bool uri_match_any(const char *uri_template, const char *uri_to_match, size_t match_upto);
   };
 
+  // Response helpers that behave like their httpd_resp_* counterparts but
+  // let middleware see and transform the response, e.g. to compress it.
+  esp_err_t resp_set_type(httpd_req_t *req, const char *type);
+  esp_err_t resp_send(httpd_req_t *req, const char *buf, ssize_t len);
+  esp_err_t resp_send_chunk(httpd_req_t *req, const char *buf, ssize_t len);
+
+  inline esp_err_t resp_sendstr(httpd_req_t *req, const char *str)
+  {
+    return resp_send(req, str, HTTPD_RESP_USE_STRLEN);
+  }
+
+  inline esp_err_t resp_sendstr_chunk(httpd_req_t *req, const char *str)
+  {
+    return resp_send_chunk(req, str, HTTPD_RESP_USE_STRLEN);
+  }
+
+  // Detach a request from the httpd task like httpd_req_async_handler_begin and
+  // httpd_req_async_handler_complete. Until it completes the socket counts as
+  // busy, so the connection manager never closes it as idle mid-response.
+  esp_err_t req_async_handler_begin(httpd_req_t *req, httpd_req_t **async_req);
+  esp_err_t req_async_handler_complete(httpd_req_t *req);
+
   esp_err_t send_json_response(httpd_req_t *req, cJSON *json);
 
 } // namespace cjf
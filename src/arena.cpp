@@ -0,0 +1,85 @@
+#include <cjf/arena.h>
+
+#include <esp_err.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+namespace cjf
+{
+
+  arena::arena(size_t capacity)
+      : _buffer(nullptr),
+        _capacity(capacity),
+        _used(0),
+        _high_water(0)
+  {
+    if (_capacity)
+    {
+      _buffer = reinterpret_cast<uint8_t *>(malloc(_capacity));
+      if (!_buffer)
+      {
+        ESP_ERROR_CHECK(ESP_ERR_NO_MEM);
+      }
+    }
+  }
+
+  arena::~arena()
+  {
+    free(_buffer);
+  }
+
+  void *arena::allocate(size_t size, size_t align)
+  {
+    uintptr_t base = reinterpret_cast<uintptr_t>(_buffer);
+    uintptr_t start = (base + _used + align - 1) & ~(uintptr_t)(align - 1);
+    size_t offset = start - base;
+    if (offset > _capacity || size > _capacity - offset)
+    {
+      return nullptr;
+    }
+    _used = offset + size;
+    if (_used > _high_water)
+    {
+      _high_water = _used;
+    }
+    return _buffer + offset;
+  }
+
+  char *arena::strdup(std::string_view str)
+  {
+    char *copy = allocate<char>(str.size() + 1);
+    if (copy)
+    {
+      memcpy(copy, str.data(), str.size());
+      copy[str.size()] = '\0';
+    }
+    return copy;
+  }
+
+  char *arena::format(const char *fmt, ...)
+  {
+    // Format straight into whatever is left of the arena, then commit only
+    // the bytes that were actually used.
+    char *out = reinterpret_cast<char *>(_buffer + _used);
+    size_t available = _capacity - _used;
+
+    va_list args;
+    va_start(args, fmt);
+    int len = vsnprintf(out, available, fmt, args);
+    va_end(args);
+
+    if (len < 0 || (size_t)len >= available)
+    {
+      return nullptr;
+    }
+    return reinterpret_cast<char *>(allocate(len + 1, 1));
+  }
+
+  void arena::reset()
+  {
+    _used = 0;
+  }
+
+} // namespace cjf
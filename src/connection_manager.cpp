@@ -0,0 +1,342 @@
+#include <cjf/connection_manager.h>
+
+#include <algorithm>
+#include <esp_check.h>
+#include <esp_log.h>
+
+namespace cjf
+{
+
+  const char *CONNECTION_MANAGER = "connection_manager";
+
+  connection_manager::connection_manager(size_t max_sockets, const connection_manager_config_t &config)
+      : _config(config),
+        _max_sockets(max_sockets),
+        _sessions(new session_t[max_sockets]),
+        _server(nullptr),
+        _reap_timer(nullptr),
+        _stats({})
+  {
+    portMUX_INITIALIZE(&_lock);
+    for (size_t i = 0; i < _max_sockets; i++)
+    {
+      _sessions[i].sockfd = -1;
+    }
+  }
+
+  connection_manager::~connection_manager()
+  {
+    stop();
+    detach();
+  }
+
+  esp_err_t connection_manager::start(httpd_handle_t server)
+  {
+    _server = server;
+    if (!_config.idle_timeout_ms)
+    {
+      return ESP_OK;
+    }
+
+    esp_timer_create_args_t args = {
+        .callback = reap_timer_callback,
+        .arg = this,
+        .dispatch_method = ESP_TIMER_TASK,
+        .name = "httpd_reaper",
+        .skip_unhandled_events = true};
+    ESP_RETURN_ON_ERROR(esp_timer_create(&args, &_reap_timer), CONNECTION_MANAGER, "Failed to create reap timer");
+    // Check twice per timeout so sockets are closed at most 1.5x the timeout
+    uint64_t period_us = std::max<uint64_t>(_config.idle_timeout_ms / 2, 1000) * 1000;
+    return esp_timer_start_periodic(_reap_timer, period_us);
+  }
+
+  void connection_manager::stop()
+  {
+    if (_reap_timer)
+    {
+      esp_timer_stop(_reap_timer);
+      esp_timer_delete(_reap_timer);
+      _reap_timer = nullptr;
+    }
+  }
+
+  void connection_manager::detach()
+  {
+    _server = nullptr;
+  }
+
+  esp_err_t connection_manager::on_open(int sockfd)
+  {
+    size_t open = 0;
+    size_t idle = 0;
+    bool tracked = false;
+    int64_t now = esp_timer_get_time();
+
+    taskENTER_CRITICAL(&_lock);
+    for (size_t i = 0; i < _max_sockets; i++)
+    {
+      auto &session = _sessions[i];
+      if (session.sockfd == -1 && !tracked)
+      {
+        session = {sockfd, now, 0, 0, false, false, false};
+        tracked = true;
+      }
+      if (session.sockfd != -1)
+      {
+        open++;
+        idle += is_idle(session) ? 1 : 0;
+      }
+    }
+    _stats.opened++;
+    taskEXIT_CRITICAL(&_lock);
+
+    if (!tracked)
+    {
+      ESP_LOGW(CONNECTION_MANAGER, "Socket %d opened with every session slot in use", sockfd);
+      return ESP_OK;
+    }
+
+    // Keep a socket free for the next connection, and the idle sockets within
+    // their quota. The new socket is idle too until its first request arrives.
+    if (open >= _max_sockets && evict_idle(sockfd))
+    {
+      idle--;
+    }
+    while (_config.max_idle_sockets && idle > _config.max_idle_sockets && evict_idle(sockfd))
+    {
+      idle--;
+    }
+    return ESP_OK;
+  }
+
+  void connection_manager::on_close(int sockfd)
+  {
+    taskENTER_CRITICAL(&_lock);
+    auto session = find(sockfd);
+    if (session)
+    {
+      session->sockfd = -1;
+    }
+    _stats.closed++;
+    taskEXIT_CRITICAL(&_lock);
+  }
+
+  void connection_manager::request_started(int sockfd)
+  {
+    taskENTER_CRITICAL(&_lock);
+    _stats.requests++;
+    auto session = find(sockfd);
+    if (session)
+    {
+      session->active = true;
+      session->last_active = esp_timer_get_time();
+      if (session->requests++)
+      {
+        _stats.reused_requests++;
+      }
+    }
+    taskEXIT_CRITICAL(&_lock);
+  }
+
+  void connection_manager::request_finished(int sockfd)
+  {
+    taskENTER_CRITICAL(&_lock);
+    auto session = find(sockfd);
+    if (session)
+    {
+      // A stream outlives its request handler, so the slot is only released
+      // when the socket closes.
+      session->active = false;
+      session->last_active = esp_timer_get_time();
+    }
+    taskEXIT_CRITICAL(&_lock);
+  }
+
+  esp_err_t connection_manager::begin_stream(int sockfd)
+  {
+    esp_err_t ret = ESP_OK;
+    taskENTER_CRITICAL(&_lock);
+    size_t streaming = 0;
+    for (size_t i = 0; i < _max_sockets; i++)
+    {
+      streaming += (_sessions[i].sockfd != -1 && _sessions[i].streaming) ? 1 : 0;
+    }
+    auto session = find(sockfd);
+    if (streaming >= _config.max_streams)
+    {
+      _stats.refused_streams++;
+      ret = ESP_ERR_NO_MEM;
+    }
+    else if (session)
+    {
+      session->streaming = true;
+    }
+    taskEXIT_CRITICAL(&_lock);
+
+    if (ret != ESP_OK)
+    {
+      ESP_LOGW(CONNECTION_MANAGER, "Refusing stream on socket %d, %u streams already open",
+               sockfd, (unsigned int)streaming);
+    }
+    return ret;
+  }
+
+  void connection_manager::end_stream(int sockfd)
+  {
+    taskENTER_CRITICAL(&_lock);
+    auto session = find(sockfd);
+    if (session)
+    {
+      session->streaming = false;
+    }
+    taskEXIT_CRITICAL(&_lock);
+  }
+
+  void connection_manager::hold(int sockfd)
+  {
+    taskENTER_CRITICAL(&_lock);
+    auto session = find(sockfd);
+    if (session)
+    {
+      session->held++;
+    }
+    taskEXIT_CRITICAL(&_lock);
+  }
+
+  void connection_manager::release(int sockfd)
+  {
+    taskENTER_CRITICAL(&_lock);
+    auto session = find(sockfd);
+    if (session && session->held)
+    {
+      session->held--;
+      session->last_active = esp_timer_get_time();
+    }
+    taskEXIT_CRITICAL(&_lock);
+  }
+
+  connection_stats_t connection_manager::stats()
+  {
+    taskENTER_CRITICAL(&_lock);
+    auto stats = _stats;
+    for (size_t i = 0; i < _max_sockets; i++)
+    {
+      auto &session = _sessions[i];
+      if (session.sockfd == -1)
+      {
+        continue;
+      }
+      stats.open++;
+      if (session.streaming)
+      {
+        stats.streaming++;
+      }
+      else if (session.active || session.held)
+      {
+        stats.active++;
+      }
+      else
+      {
+        stats.idle++;
+      }
+    }
+    taskEXIT_CRITICAL(&_lock);
+    stats.reuse_ratio = stats.requests ? (float)stats.reused_requests / stats.requests : 0;
+    return stats;
+  }
+
+  bool connection_manager::is_idle(const session_t &session)
+  {
+    return !session.active && !session.held && !session.streaming && !session.closing;
+  }
+
+  connection_manager::session_t *connection_manager::find(int sockfd)
+  {
+    for (size_t i = 0; i < _max_sockets; i++)
+    {
+      if (_sessions[i].sockfd == sockfd)
+      {
+        return &_sessions[i];
+      }
+    }
+    return nullptr;
+  }
+
+  bool connection_manager::evict_idle(int keep_sockfd)
+  {
+    session_t *lru = nullptr;
+    taskENTER_CRITICAL(&_lock);
+    for (size_t i = 0; i < _max_sockets; i++)
+    {
+      auto &session = _sessions[i];
+      if (session.sockfd == -1 || session.sockfd == keep_sockfd || !is_idle(session))
+      {
+        continue;
+      }
+      if (!lru || session.last_active < lru->last_active)
+      {
+        lru = &session;
+      }
+    }
+    int sockfd = -1;
+    if (lru)
+    {
+      lru->closing = true;
+      sockfd = lru->sockfd;
+      _stats.evicted++;
+    }
+    taskEXIT_CRITICAL(&_lock);
+
+    if (sockfd == -1 || !_server)
+    {
+      return false;
+    }
+    ESP_LOGI(CONNECTION_MANAGER, "Evicting idle socket %d", sockfd);
+    httpd_sess_trigger_close(_server, sockfd);
+    return true;
+  }
+
+  void connection_manager::reap_idle()
+  {
+    if (!_server)
+    {
+      return;
+    }
+    int64_t expired = esp_timer_get_time() - (int64_t)_config.idle_timeout_ms * 1000;
+    for (size_t i = 0; i < _max_sockets; i++)
+    {
+      int sockfd = -1;
+      taskENTER_CRITICAL(&_lock);
+      auto &session = _sessions[i];
+      if (session.sockfd != -1 && is_idle(session) && session.last_active < expired)
+      {
+        session.closing = true;
+        sockfd = session.sockfd;
+        _stats.reaped++;
+      }
+      taskEXIT_CRITICAL(&_lock);
+
+      if (sockfd != -1)
+      {
+        ESP_LOGI(CONNECTION_MANAGER, "Closing idle socket %d", sockfd);
+        httpd_sess_trigger_close(_server, sockfd);
+      }
+    }
+  }
+
+  void connection_manager::reap_timer_callback(void *arg)
+  {
+    // Sessions belong to the httpd task, so do the reaping there
+    auto self = reinterpret_cast<connection_manager *>(arg);
+    if (self->_server)
+    {
+      httpd_queue_work(self->_server, reap_work, self);
+    }
+  }
+
+  void connection_manager::reap_work(void *arg)
+  {
+    reinterpret_cast<connection_manager *>(arg)->reap_idle();
+  }
+
+} // namespace cjf
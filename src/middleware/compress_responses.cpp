@@ -0,0 +1,420 @@
+#include <cjf/middleware/compress_responses.h>
+#include <cjf/request_context.h>
+
+#include <esp_http_server.h>
+#include <esp_log.h>
+#include <stdlib.h>
+#include <string.h>
+#include <string_view>
+#include <zlib.h>
+
+namespace cjf
+{
+
+  const char *COMPRESS_RESPONSES_MIDDLEWARE = "middleware:compress_responses";
+
+  const char *const COMPRESS_RESPONSES_DEFAULT_MIME_TYPES[] = {
+      "text/html",
+      "text/css",
+      "text/plain",
+      "application/javascript",
+      "application/json",
+      "image/svg+xml",
+      nullptr};
+
+  static std::string_view trim(std::string_view str)
+  {
+    size_t start = str.find_first_not_of(" \t");
+    if (start == std::string_view::npos)
+    {
+      return {};
+    }
+    return str.substr(start, str.find_last_not_of(" \t") - start + 1);
+  }
+
+  /**
+   * @brief Returns true if the request's Accept-Encoding allows gzip.
+   */
+  static bool accepts_gzip(httpd_req_t *req, request_context *context)
+  {
+    size_t size = httpd_req_get_hdr_value_len(req, "Accept-Encoding");
+    if (!size)
+    {
+      return false;
+    }
+    char *value = context->scratch().allocate<char>(size + 1);
+    if (!value || httpd_req_get_hdr_value_str(req, "Accept-Encoding", value, size + 1) != ESP_OK)
+    {
+      return false;
+    }
+
+    std::string_view encodings(value, size);
+    while (!encodings.empty())
+    {
+      size_t comma = encodings.find(',');
+      auto coding = encodings.substr(0, comma);
+      encodings = (comma == std::string_view::npos) ? std::string_view() : encodings.substr(comma + 1);
+
+      size_t semicolon = coding.find(';');
+      auto name = trim(coding.substr(0, semicolon));
+      if (name.size() != 4 || strncasecmp(name.data(), "gzip", 4) != 0)
+      {
+        continue;
+      }
+      // "gzip;q=0" explicitly refuses gzip
+      auto params = (semicolon == std::string_view::npos) ? std::string_view() : coding.substr(semicolon + 1);
+      size_t q = params.find("q=");
+      return q == std::string_view::npos || strtod(params.data() + q + 2, nullptr) > 0;
+    }
+    return false;
+  }
+
+  static bool mime_type_allowed(const char *const *mime_types, const char *content_type)
+  {
+    // The type is only known if it was set with resp_set_type. One set with
+    // httpd_resp_set_type, e.g. image/png, may not compress at all.
+    if (!content_type)
+    {
+      return false;
+    }
+    std::string_view type = content_type;
+    type = trim(type.substr(0, type.find(';')));
+    for (auto mime_type = mime_types; mime_type && *mime_type; mime_type++)
+    {
+      if (type == *mime_type)
+      {
+        return true;
+      }
+    }
+    return false;
+  }
+
+  /**
+   * @brief Compresses the response of a single request.
+   *
+   * Output is held back until min_size bytes have been seen, at which point the
+   * writer commits to either compressing or passing the response through.
+   */
+  class compress_responses::writer : public response_writer
+  {
+  public:
+    enum state_t
+    {
+      UNDECIDED,
+      PASSTHROUGH,
+      COMPRESSING,
+      FINISHED,
+    };
+
+    writer(compress_responses *self, request_context *context)
+        : _self(self),
+          _context(context),
+          _next(context->writer()),
+          _state(UNDECIDED),
+          _pending_size(0),
+          _bytes_in(0),
+          _bytes_out(0)
+    {
+    }
+
+    esp_err_t send(httpd_req_t *req, const char *buf, size_t len) override
+    {
+      if (_state == UNDECIDED && _pending_size)
+      {
+        // Chunks were already sent, so finish the response as a chunked one
+        esp_err_t ret = send_chunk(req, buf, len);
+        return (ret == ESP_OK) ? send_chunk(req, nullptr, 0) : ret;
+      }
+      if (_state == UNDECIDED)
+      {
+        if (len >= _self->_config.min_size && compressible() && start(req))
+        {
+          return compress(req, buf, len, true);
+        }
+        _state = PASSTHROUGH;
+      }
+      if (_state == COMPRESSING)
+      {
+        return compress(req, buf, len, true);
+      }
+      return forward_send(_next, req, buf, len);
+    }
+
+    esp_err_t send_chunk(httpd_req_t *req, const char *buf, size_t len) override
+    {
+      if (_state == UNDECIDED)
+      {
+        if (!compressible())
+        {
+          _state = PASSTHROUGH;
+          esp_err_t ret = flush_pending(req);
+          return (ret == ESP_OK) ? forward_send_chunk(_next, req, buf, len) : ret;
+        }
+        if (len == 0)
+        {
+          // The response ended before reaching min_size. Send it in one go,
+          // which also lets httpd set Content-Length.
+          _state = PASSTHROUGH;
+          esp_err_t ret = forward_send(_next, req, _self->_pending, _pending_size);
+          _pending_size = 0;
+          return ret;
+        }
+        if (_pending_size + len < _self->_config.min_size)
+        {
+          memcpy(_self->_pending + _pending_size, buf, len);
+          _pending_size += len;
+          return ESP_OK;
+        }
+        if (!start(req))
+        {
+          esp_err_t ret = flush_pending(req);
+          return (ret == ESP_OK) ? forward_send_chunk(_next, req, buf, len) : ret;
+        }
+        if (_pending_size)
+        {
+          esp_err_t ret = compress(req, _self->_pending, _pending_size, false);
+          _pending_size = 0;
+          if (ret != ESP_OK)
+          {
+            return ret;
+          }
+        }
+      }
+      if (_state == COMPRESSING)
+      {
+        return compress(req, buf, len, len == 0);
+      }
+      return forward_send_chunk(_next, req, buf, len);
+    }
+
+    /**
+     * @brief Sends anything still held back once downstream middleware returns.
+     */
+    esp_err_t flush_pending(httpd_req_t *req)
+    {
+      if (!_pending_size)
+      {
+        return ESP_OK;
+      }
+      esp_err_t ret = forward_send_chunk(_next, req, _self->_pending, _pending_size);
+      _pending_size = 0;
+      return ret;
+    }
+
+    response_writer *next() const { return _next; }
+    state_t state() const { return _state; }
+    size_t bytes_in() const { return _bytes_in; }
+    size_t bytes_out() const { return _bytes_out; }
+
+  private:
+    bool compressible() const
+    {
+      return mime_type_allowed(_self->_config.mime_types, _context->content_type());
+    }
+
+    /**
+     * @brief Switches to compressing, or to passing the response through if
+     * the compressor or the response headers can't be set up.
+     *
+     * @return true if the response will be compressed.
+     */
+    bool start(httpd_req_t *req)
+    {
+      _state = PASSTHROUGH;
+      if (deflateReset(_self->_stream) != Z_OK)
+      {
+        ESP_LOGW(COMPRESS_RESPONSES_MIDDLEWARE, "Failed to reset compressor, sending uncompressed");
+        return false;
+      }
+      // httpd can't remove a header once set, so set Content-Encoding last.
+      // A stray Vary on an uncompressed response is harmless.
+      if (httpd_resp_set_hdr(req, "Vary", "Accept-Encoding") != ESP_OK ||
+          httpd_resp_set_hdr(req, "Content-Encoding", "gzip") != ESP_OK)
+      {
+        ESP_LOGW(COMPRESS_RESPONSES_MIDDLEWARE, "No room for response headers, sending uncompressed");
+        return false;
+      }
+      _state = COMPRESSING;
+      return true;
+    }
+
+    esp_err_t compress(httpd_req_t *req, const char *buf, size_t len, bool finish)
+    {
+      z_stream *stream = _self->_stream;
+      stream->next_in = reinterpret_cast<Bytef *>(const_cast<char *>(buf));
+      stream->avail_in = len;
+      _bytes_in += len;
+
+      int ret;
+      do
+      {
+        stream->next_out = reinterpret_cast<Bytef *>(_self->_output);
+        stream->avail_out = _self->_config.output_size;
+        ret = deflate(stream, finish ? Z_FINISH : Z_NO_FLUSH);
+        if (ret == Z_STREAM_ERROR)
+        {
+          ESP_LOGE(COMPRESS_RESPONSES_MIDDLEWARE, "Compression failed");
+          return ESP_FAIL;
+        }
+        size_t size = _self->_config.output_size - stream->avail_out;
+        if (size)
+        {
+          esp_err_t err = forward_send_chunk(_next, req, _self->_output, size);
+          if (err != ESP_OK)
+          {
+            return err;
+          }
+          _bytes_out += size;
+        }
+      } while (finish ? ret != Z_STREAM_END : stream->avail_out == 0);
+
+      if (finish)
+      {
+        _state = FINISHED;
+        return forward_send_chunk(_next, req, nullptr, 0);
+      }
+      return ESP_OK;
+    }
+
+    compress_responses *_self;
+    request_context *_context;
+    response_writer *_next;
+    state_t _state;
+    size_t _pending_size;
+    size_t _bytes_in;
+    size_t _bytes_out;
+  };
+
+  compress_responses::compress_responses(const compress_responses_config_t &config)
+      : middleware_t({name, compress_responses_handler, this}),
+        _config(config),
+        _pool(nullptr),
+        _pool_size(0),
+        _pool_used(0),
+        _stream(nullptr),
+        _pending(nullptr),
+        _output(nullptr),
+        _busy(false),
+        _stats({})
+  {
+    portMUX_INITIALIZE(&_stats_lock);
+
+    // zlib documents deflate's memory use as (1 << (windowBits + 2)) +
+    // (1 << (memLevel + 9)) plus a few kilobytes for small objects. Everything
+    // the middleware needs is carved out of a single allocation made here.
+    _pool_size = (1 << (_config.window_bits + 2)) + (1 << (_config.mem_level + 9)) + 8 * 1024 +
+                 sizeof(z_stream) + _config.min_size + _config.output_size;
+    _pool = reinterpret_cast<uint8_t *>(malloc(_pool_size));
+    if (!_pool)
+    {
+      ESP_ERROR_CHECK(ESP_ERR_NO_MEM);
+    }
+
+    _stream = reinterpret_cast<z_stream *>(pool_alloc(this, 1, sizeof(z_stream)));
+    _pending = reinterpret_cast<char *>(pool_alloc(this, 1, _config.min_size));
+    _output = reinterpret_cast<char *>(pool_alloc(this, 1, _config.output_size));
+    memset(_stream, 0, sizeof(z_stream));
+    _stream->zalloc = pool_alloc;
+    _stream->zfree = pool_free;
+    _stream->opaque = this;
+
+    // Adding 16 to windowBits makes zlib write a gzip header and trailer
+    if (deflateInit2(_stream, _config.level, Z_DEFLATED, _config.window_bits + 16,
+                     _config.mem_level, Z_DEFAULT_STRATEGY) != Z_OK)
+    {
+      ESP_LOGE(COMPRESS_RESPONSES_MIDDLEWARE, "Failed to initialise compressor, responses will not be compressed");
+      _stream = nullptr;
+    }
+    else
+    {
+      ESP_LOGI(COMPRESS_RESPONSES_MIDDLEWARE, "Compressor using %u of %u bytes",
+               (unsigned int)_pool_used, (unsigned int)_pool_size);
+    }
+  }
+
+  compress_responses::~compress_responses()
+  {
+    if (_stream)
+    {
+      deflateEnd(_stream);
+    }
+    free(_pool);
+  }
+
+  compress_responses_stats_t compress_responses::stats()
+  {
+    taskENTER_CRITICAL(&_stats_lock);
+    auto stats = _stats;
+    taskEXIT_CRITICAL(&_stats_lock);
+    return stats;
+  }
+
+  void *compress_responses::pool_alloc(void *opaque, unsigned int items, unsigned int size)
+  {
+    auto self = reinterpret_cast<compress_responses *>(opaque);
+    size_t start = (self->_pool_used + 7) & ~(size_t)7;
+    size_t bytes = (size_t)items * size;
+    if (start > self->_pool_size || bytes > self->_pool_size - start)
+    {
+      return Z_NULL;
+    }
+    self->_pool_used = start + bytes;
+    return self->_pool + start;
+  }
+
+  void compress_responses::pool_free(void *opaque, void *address)
+  {
+    // The pool lives as long as the middleware
+  }
+
+  esp_err_t compress_responses::compress_responses_handler(httpd_req_t *req, middleware_next_t next)
+  {
+    auto self = reinterpret_cast<compress_responses *>(req->user_ctx);
+    auto context = request_context::from(req);
+    if (!self->_stream || !context || !accepts_gzip(req, context))
+    {
+      return next();
+    }
+    // The compressor can only serve one response at a time
+    if (self->_busy)
+    {
+      taskENTER_CRITICAL(&self->_stats_lock);
+      self->_stats.skipped++;
+      taskEXIT_CRITICAL(&self->_stats_lock);
+      return next();
+    }
+
+    self->_busy = true;
+    writer response(self, context);
+    context->set_writer(&response);
+    esp_err_t ret = next();
+    context->set_writer(response.next());
+    if (ret == ESP_OK)
+    {
+      ret = response.flush_pending(req);
+    }
+    self->_busy = false;
+
+    bool compressed = response.state() == writer::COMPRESSING || response.state() == writer::FINISHED;
+    taskENTER_CRITICAL(&self->_stats_lock);
+    if (compressed)
+    {
+      self->_stats.compressed++;
+      self->_stats.bytes_in += response.bytes_in();
+      self->_stats.bytes_out += response.bytes_out();
+    }
+    else
+    {
+      self->_stats.skipped++;
+    }
+    taskEXIT_CRITICAL(&self->_stats_lock);
+
+    if (compressed)
+    {
+      ESP_LOGD(COMPRESS_RESPONSES_MIDDLEWARE, "Compressed %u bytes to %u",
+               (unsigned int)response.bytes_in(), (unsigned int)response.bytes_out());
+    }
+    return ret;
+  }
+
+} // namespace cjf
@@ -2,8 +2,11 @@
 #include <cjf/mime.h>
 #include <cjf/web_server.h>
 
+#include <algorithm>
 #include <esp_log.h>
 #include <stdio.h>
+#include <string.h>
+#include <string_view>
 #include <sys/stat.h>
 
 namespace cjf
@@ -11,15 +14,28 @@ namespace cjf
 
   const char *FILES_MIDDLEWARE = "middleware:files";
 
+  static const size_t FILES_ARENA_RESERVE = 256;
+
   /**
-   * @brief Extracts the path from the given URI.
-   *
-   * @param uri The URI from which to extract the path.
-   * @return The extracted path as a string.
+   * @brief Returns false if a decoded path could escape base_path or would be
+   * cut short when used as a C string.
    */
-  static std::string get_path_from_uri(const std::string uri)
+  static bool is_safe_path(std::string_view path)
   {
-    return uri.substr(0, uri.find_first_of("?#"));
+    if (path.find('\0') != std::string_view::npos)
+    {
+      return false;
+    }
+    while (!path.empty())
+    {
+      size_t separator = path.find_first_of("/\\");
+      if (path.substr(0, separator) == "..")
+      {
+        return false;
+      }
+      path = (separator == std::string_view::npos) ? std::string_view() : path.substr(separator + 1);
+    }
+    return true;
   }
 
   get_files_from_storage::get_files_from_storage(const get_files_from_storage_config_t &config)
@@ -30,19 +46,26 @@ namespace cjf
   esp_err_t get_files_from_storage::get_files_from_storage_handler(httpd_req_t *req, middleware_next_t next)
   {
     auto self = reinterpret_cast<get_files_from_storage *>(req->user_ctx);
-    std::string uri_path = get_path_from_uri(req->uri);
+    auto context = request_context::from(req);
+    if (!context)
+    {
+      ESP_LOGE(FILES_MIDDLEWARE, "No request context");
+      httpd_resp_send_500(req);
+      return ESP_OK;
+    }
+    std::string_view uri_path = context->decoded_path();
 
-    if (!uri_path.starts_with('/'))
+    // Encoded sequences such as %2e%2e%2f and %00 are decoded by now
+    if (!uri_path.starts_with('/') || !is_safe_path(uri_path))
     {
       ESP_LOGE(FILES_MIDDLEWARE, "Invalid path");
       httpd_resp_send_err(req, HTTPD_400_BAD_REQUEST, "Invalid path");
+      return ESP_OK;
     }
 
-    // Map the URI path to a file path
-    std::string file_path = self->_config.base_path + uri_path;
-
     // Validate the file path is not too long for the filesystem
-    if (file_path.size() > self->_config.max_path_size)
+    size_t base_path_size = strlen(self->_config.base_path);
+    if (base_path_size + uri_path.size() > self->_config.max_path_size)
     {
       // Don't include the path in the error messages - if it's too long
       // for the filesystem it's probably too long for the logger.
@@ -51,18 +74,25 @@ namespace cjf
       return ESP_OK;
     }
 
-    // If the name has a trailing '/', assume it's a directory and respond with
-    // the index file.
-    if (file_path.ends_with('/'))
+    // Map the URI path to a file path. If the name has a trailing '/', assume
+    // it's a directory and respond with the index file.
+    const char *index_filename = uri_path.ends_with('/') ? self->_config.index_filename : "";
+    char *file_path = context->scratch().format("%s%.*s%s",
+                                                self->_config.base_path,
+                                                (int)uri_path.size(), uri_path.data(),
+                                                index_filename);
+    if (!file_path)
     {
-      file_path += self->_config.index_filename;
+      ESP_LOGE(FILES_MIDDLEWARE, "Request arena exhausted");
+      httpd_resp_send_err(req, HTTPD_500_INTERNAL_SERVER_ERROR, "Out of memory");
+      return ESP_OK;
     }
 
-    ESP_LOGI(FILES_MIDDLEWARE, "Responding with file \"%s\"", file_path.c_str());
+    ESP_LOGI(FILES_MIDDLEWARE, "Responding with file \"%s\"", file_path);
 
     // Check that the requested file exists
     struct stat file_stat;
-    if (stat(file_path.c_str(), &file_stat) == -1)
+    if (stat(file_path, &file_stat) == -1)
     {
       ESP_LOGE(FILES_MIDDLEWARE, "Failed to stat file");
       httpd_resp_send_404(req);
@@ -70,7 +100,7 @@ namespace cjf
     }
     ESP_LOGI(FILES_MIDDLEWARE, "File size: %ld bytes", file_stat.st_size);
 
-    FILE *fd = fopen(file_path.c_str(), "r");
+    FILE *fd = fopen(file_path, "r");
     if (!fd)
     {
       ESP_LOGE(FILES_MIDDLEWARE, "Failed to open file");
@@ -89,8 +119,21 @@ namespace cjf
     // Send the file contents in chunks
     // TODO: Consider using async http response to avoid blocking other requests
     // while the file is being sent.
-    size_t max_chunk_size = self->_config.chunk_size;
-    char *chunk = reinterpret_cast<char *>(malloc(max_chunk_size));
+    // Read in chunks that fit in the request arena rather than falling back to
+    // the heap, leaving a little room for whatever still needs the arena once
+    // the response starts, e.g. the Server-Timing header.
+    auto &scratch = context->scratch();
+    size_t available = scratch.available();
+    available = (available > FILES_ARENA_RESERVE) ? available - FILES_ARENA_RESERVE : available;
+    size_t max_chunk_size = std::min(self->_config.chunk_size, available);
+    char *chunk = max_chunk_size ? scratch.allocate<char>(max_chunk_size) : nullptr;
+    if (!chunk)
+    {
+      fclose(fd);
+      ESP_LOGE(FILES_MIDDLEWARE, "Request arena exhausted");
+      httpd_resp_send_err(req, HTTPD_500_INTERNAL_SERVER_ERROR, "Out of memory");
+      return ESP_OK;
+    }
     size_t chunk_size;
     do
     {
@@ -98,13 +141,12 @@ namespace cjf
 
       if (chunk_size > 0)
       {
-        if (httpd_resp_send_chunk(req, chunk, chunk_size) != ESP_OK)
+        if (resp_send_chunk(req, chunk, chunk_size) != ESP_OK)
         {
           fclose(fd);
-          free(chunk);
           ESP_LOGE(FILES_MIDDLEWARE, "File sending failed");
           // Abort sending file
-          httpd_resp_sendstr_chunk(req, NULL);
+          resp_sendstr_chunk(req, NULL);
           httpd_resp_send_err(req, HTTPD_500_INTERNAL_SERVER_ERROR, "Failed to send file");
           return ESP_FAIL;
         }
@@ -114,8 +156,7 @@ namespace cjf
     } while (chunk_size != 0);
 
     fclose(fd);
-    free(chunk);
-    httpd_resp_sendstr_chunk(req, NULL);
+    resp_sendstr_chunk(req, NULL);
     return ESP_OK;
   }
 
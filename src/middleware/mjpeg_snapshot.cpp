@@ -0,0 +1,233 @@
+#include <cjf/middleware/mjpeg_snapshot.h>
+#include <cjf/request_context.h>
+#include <algorithm>
+#include <esp_check.h>
+#include <esp_http_server.h>
+#include <esp_log.h>
+#include <stdio.h>
+#include <string.h>
+
+namespace cjf
+{
+
+  const char *MJPEG_SNAPSHOT_MIDDLEWARE = "middleware:mjpeg_snapshot";
+
+  // "<stream id>-<sequence>" including the quotes
+  constexpr size_t ETAG_SIZE = sizeof("\"ffffffff-4294967295\"");
+
+  static void format_etag(char *etag, uint32_t stream_id, uint32_t sequence)
+  {
+    snprintf(etag, ETAG_SIZE, "\"%08lx-%lu\"", (unsigned long)stream_id, (unsigned long)sequence);
+  }
+
+  /**
+   * @brief Returns true if the request's If-None-Match header contains etag.
+   */
+  static bool etag_matches(httpd_req_t *req, request_context *context, const char *etag)
+  {
+    size_t size = httpd_req_get_hdr_value_len(req, "If-None-Match");
+    if (!size)
+    {
+      return false;
+    }
+    char *if_none_match = context->scratch().allocate<char>(size + 1);
+    if (!if_none_match || httpd_req_get_hdr_value_str(req, "If-None-Match", if_none_match, size + 1) != ESP_OK)
+    {
+      return false;
+    }
+    return strstr(if_none_match, etag) != nullptr;
+  }
+
+  mjpeg_snapshot::mjpeg_snapshot(mjpeg_stream &stream, const mjpeg_snapshot_config_t &config)
+      : middleware_t({name, mjpeg_snapshot_handler, this}),
+        _stream(stream),
+        _config(config),
+        _long_polls(new long_poll_t[config.max_long_polls]),
+        _long_poll_count(0),
+        _task(nullptr)
+  {
+    portMUX_INITIALIZE(&_long_polls_lock);
+    if (!_long_polls)
+    {
+      ESP_ERROR_CHECK(ESP_ERR_NO_MEM);
+    }
+    _stream.keep_latest_frame();
+  }
+
+  mjpeg_snapshot::~mjpeg_snapshot()
+  {
+    if (_task)
+    {
+      vTaskDelete(_task);
+    }
+    while (_long_poll_count)
+    {
+      finish_long_poll(0, nullptr, 0);
+    }
+  }
+
+  esp_err_t mjpeg_snapshot::respond(httpd_req_t *req, const std::shared_ptr<camera_fb_t> &frame, const char *etag,
+                                    bool not_modified)
+  {
+    if (!frame)
+    {
+      ESP_LOGW(MJPEG_SNAPSHOT_MIDDLEWARE, "No frame available");
+      httpd_resp_set_status(req, "503 Service Unavailable");
+      httpd_resp_set_hdr(req, "Retry-After", "1");
+      return httpd_resp_sendstr(req, "No frame available");
+    }
+
+    httpd_resp_set_hdr(req, "ETag", etag);
+    if (_config.cache_control)
+    {
+      httpd_resp_set_hdr(req, "Cache-Control", _config.cache_control);
+    }
+
+    if (not_modified)
+    {
+      httpd_resp_set_status(req, "304 Not Modified");
+      return httpd_resp_send(req, nullptr, 0);
+    }
+
+    ESP_LOGD(MJPEG_SNAPSHOT_MIDDLEWARE, "Sending frame %s (%u bytes)", etag, (unsigned int)frame->len);
+    httpd_resp_set_type(req, "image/jpeg");
+    // httpd_resp_send sets Content-Length. frame keeps the buffer alive even if
+    // a newer frame is written while it is being sent.
+    return httpd_resp_send(req, reinterpret_cast<const char *>(frame->buf), frame->len);
+  }
+
+  esp_err_t mjpeg_snapshot::start_long_poll(httpd_req_t *req, uint32_t sequence)
+  {
+    if (long_poll_count() >= _config.max_long_polls)
+    {
+      return ESP_ERR_NO_MEM;
+    }
+
+    if (!_task &&
+        xTaskCreate(long_poll_task, "mjpeg_snapshot", _config.task_stack_size, this,
+                    _config.task_priority, &_task) != pdPASS)
+    {
+      _task = nullptr;
+      ESP_LOGE(MJPEG_SNAPSHOT_MIDDLEWARE, "Failed to create long poll task");
+      return ESP_FAIL;
+    }
+
+    // Hand the request over to the long poll task so that httpd can move on
+    httpd_req_t *poll_req;
+    ESP_RETURN_ON_ERROR(req_async_handler_begin(req, &poll_req), MJPEG_SNAPSHOT_MIDDLEWARE, "Failed to detach long poll");
+
+    taskENTER_CRITICAL(&_long_polls_lock);
+    _long_polls[_long_poll_count++] = {poll_req, sequence, xTaskGetTickCount()};
+    taskEXIT_CRITICAL(&_long_polls_lock);
+    xTaskNotifyGive(_task);
+    return ESP_OK;
+  }
+
+  size_t mjpeg_snapshot::long_poll_count()
+  {
+    taskENTER_CRITICAL(&_long_polls_lock);
+    size_t count = _long_poll_count;
+    taskEXIT_CRITICAL(&_long_polls_lock);
+    return count;
+  }
+
+  TickType_t mjpeg_snapshot::finish_long_polls()
+  {
+    uint32_t sequence;
+    auto frame = _stream.latest_frame(&sequence);
+    TickType_t now = xTaskGetTickCount();
+    TickType_t next_timeout = portMAX_DELAY;
+
+    // Long polls are only added by the httpd task and only removed here, so
+    // the one at index stays put while it is answered.
+    size_t index = 0;
+    while (true)
+    {
+      taskENTER_CRITICAL(&_long_polls_lock);
+      bool found = index < _long_poll_count;
+      long_poll_t poll = found ? _long_polls[index] : long_poll_t{};
+      taskEXIT_CRITICAL(&_long_polls_lock);
+      if (!found)
+      {
+        break;
+      }
+
+      TickType_t elapsed = now - poll.start;
+      if ((frame && sequence > poll.sequence) || elapsed >= _config.long_poll_ticks)
+      {
+        finish_long_poll(index, frame, sequence);
+        continue;
+      }
+      next_timeout = std::min(next_timeout, _config.long_poll_ticks - elapsed);
+      index++;
+    }
+    return next_timeout;
+  }
+
+  void mjpeg_snapshot::finish_long_poll(size_t index, const std::shared_ptr<camera_fb_t> &frame, uint32_t sequence)
+  {
+    taskENTER_CRITICAL(&_long_polls_lock);
+    long_poll_t poll = _long_polls[index];
+    _long_polls[index] = _long_polls[--_long_poll_count];
+    taskEXIT_CRITICAL(&_long_polls_lock);
+
+    // Without a newer frame the client gets what it would have got straight away
+    char etag[ETAG_SIZE];
+    format_etag(etag, _stream.stream_id(), sequence);
+    if (respond(poll.req, frame, etag, frame && sequence == poll.sequence) != ESP_OK)
+    {
+      httpd_sess_trigger_close(poll.req->handle, httpd_req_to_sockfd(poll.req));
+    }
+    req_async_handler_complete(poll.req);
+  }
+
+  void mjpeg_snapshot::long_poll_task(void *arg)
+  {
+    auto self = reinterpret_cast<mjpeg_snapshot *>(arg);
+    while (true)
+    {
+      if (!self->long_poll_count())
+      {
+        ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+        continue;
+      }
+      uint32_t sequence;
+      self->_stream.latest_frame(&sequence);
+      TickType_t next_timeout = self->finish_long_polls();
+      if (next_timeout != portMAX_DELAY)
+      {
+        // Requests added in the meantime time out later than the ones here
+        self->_stream.wait_for_frame(sequence, next_timeout);
+      }
+    }
+  }
+
+  esp_err_t mjpeg_snapshot::mjpeg_snapshot_handler(httpd_req_t *req, middleware_next_t next)
+  {
+    auto self = reinterpret_cast<mjpeg_snapshot *>(req->user_ctx);
+    auto context = request_context::from(req);
+    if (req->method != HTTP_GET || !context)
+    {
+      return next();
+    }
+
+    uint32_t sequence;
+    auto frame = self->_stream.latest_frame(&sequence);
+    char *etag = context->scratch().allocate<char>(ETAG_SIZE);
+    if (!etag)
+    {
+      httpd_resp_send_err(req, HTTPD_500_INTERNAL_SERVER_ERROR, "Out of memory");
+      return ESP_OK;
+    }
+    format_etag(etag, self->_stream.stream_id(), sequence);
+
+    bool not_modified = frame && etag_matches(req, context, etag);
+    if ((!frame || not_modified) && self->_config.long_poll_ticks &&
+        self->start_long_poll(req, sequence) == ESP_OK)
+    {
+      return ESP_OK;
+    }
+    return self->respond(req, frame, etag, not_modified);
+  }
+
+} // namespace cjf
@@ -1,20 +1,120 @@
 #include <cjf/middleware/mjpeg_stream.h>
 
+#include <esp_random.h>
+#include <new>
+
 namespace cjf
 {
 
+  // Frames alternate between these bits so that a waiter that checks the
+  // sequence number just before a write still sees the write happen.
+  const EventBits_t FRAME_EVEN = 0x01;
+  const EventBits_t FRAME_ODD = 0x02;
+
+  static EventBits_t frame_bit(uint32_t sequence)
+  {
+    return (sequence & 1) ? FRAME_ODD : FRAME_EVEN;
+  }
+
   mjpeg_stream::mjpeg_stream(const mjpeg_stream_config_t &config)
       : multipart_stream(name, {.boundary = config.boundary,
                                 .part_content_type = "video/x-motion-jpeg",
                                 .on_stream_start = config.on_stream_start,
                                 .on_stream_end = config.on_stream_end,
-                                .ctx = config.ctx})
+                                .ctx = config.ctx,
+                                .max_subscribers = config.max_subscribers,
+                                .task_stack_size = config.task_stack_size,
+                                .task_priority = config.task_priority}),
+        _stream_id(esp_random()),
+        _frame_sequence(0),
+        _keep_latest_frame(false)
+  {
+    _frame_lock = xSemaphoreCreateMutex();
+    _frame_events = xEventGroupCreate();
+    if (!_frame_lock || !_frame_events)
+    {
+      ESP_ERROR_CHECK(ESP_ERR_NO_MEM);
+    }
+  }
+
+  mjpeg_stream::~mjpeg_stream()
+  {
+    if (_frame_events)
+    {
+      vEventGroupDelete(_frame_events);
+    }
+    if (_frame_lock)
+    {
+      vSemaphoreDelete(_frame_lock);
+    }
+  }
+
+  esp_err_t mjpeg_stream::write(std::shared_ptr<camera_fb_t> frame, TickType_t ticks_to_wait)
+  {
+    xSemaphoreTake(_frame_lock, portMAX_DELAY);
+    uint32_t sequence = _frame_sequence + 1;
+    // Clear the bit the next write sets before anyone can see this sequence,
+    // so that waiting for sequence + 1 doesn't wake on a stale bit.
+    xEventGroupClearBits(_frame_events, frame_bit(sequence + 1));
+    if (_keep_latest_frame)
+    {
+      _frame = frame;
+    }
+    _frame_sequence = sequence;
+    xEventGroupSetBits(_frame_events, frame_bit(sequence));
+    xSemaphoreGive(_frame_lock);
+
+    // The sender task may still be sending the frame after a timeout, so it
+    // gets a reference of its own
+    auto sending = new (std::nothrow) std::shared_ptr<camera_fb_t>(frame);
+    if (!sending)
+    {
+      return ESP_ERR_NO_MEM;
+    }
+    return multipart_stream::write(reinterpret_cast<char *>(frame->buf), frame->len, release_frame, sending, ticks_to_wait);
+  }
+
+  void mjpeg_stream::release_frame(void *ctx)
+  {
+    delete reinterpret_cast<std::shared_ptr<camera_fb_t> *>(ctx);
+  }
+
+  void mjpeg_stream::keep_latest_frame()
+  {
+    xSemaphoreTake(_frame_lock, portMAX_DELAY);
+    _keep_latest_frame = true;
+    xSemaphoreGive(_frame_lock);
+  }
+
+  std::shared_ptr<camera_fb_t> mjpeg_stream::latest_frame(uint32_t *sequence)
   {
+    xSemaphoreTake(_frame_lock, portMAX_DELAY);
+    auto frame = _frame;
+    *sequence = _frame_sequence;
+    xSemaphoreGive(_frame_lock);
+    return frame;
   }
 
-  void mjpeg_stream::write(std::shared_ptr<camera_fb_t> frame)
+  esp_err_t mjpeg_stream::wait_for_frame(uint32_t sequence, TickType_t ticks_to_wait)
   {
-    multipart_stream::write(reinterpret_cast<char *>(frame->buf), frame->len);
+    TickType_t start = xTaskGetTickCount();
+    while (true)
+    {
+      // The sequence is the source of truth, the bits only say when to look again
+      uint32_t latest;
+      latest_frame(&latest);
+      if (latest > sequence)
+      {
+        return ESP_OK;
+      }
+      TickType_t elapsed = xTaskGetTickCount() - start;
+      if (elapsed >= ticks_to_wait)
+      {
+        return ESP_ERR_TIMEOUT;
+      }
+      EventBits_t next = frame_bit(latest + 1);
+      xEventGroupWaitBits(_frame_events, next, pdFALSE, pdTRUE, ticks_to_wait - elapsed);
+    }
   }
 
 } // namespace cjf
@@ -1,10 +1,12 @@
 #include <cjf/middleware/multipart_stream.h>
+#include <cjf/request_context.h>
 #include <esp_check.h>
 #include <esp_err.h>
 #include <esp_log.h>
 #include <esp_timer.h>
 #include <esp_http_server.h>
 #include <freertos/event_groups.h>
+#include <stdio.h>
 #include <string>
 
 namespace cjf
@@ -48,12 +50,23 @@ namespace cjf
   multipart_stream::multipart_stream(const char* name, const multipart_stream_config_t config)
       : middleware_t({name, multipart_stream::multipart_stream_handler, this}),
         _config(config),
+        _part(nullptr),
+        _part_release(nullptr),
+        _part_release_ctx(nullptr),
         _part_boundary(part_boundary(config.boundary)),
         _part_content_type(part_content_type(config.part_content_type)),
-        _stream_content_type(stream_content_type(config.boundary))
+        _part_size(0),
+        _send_time(0),
+        _stream_content_type(stream_content_type(config.boundary)),
+        _part_headers_size(_part_content_type.size() + sizeof("Content-Length: 4294967295\r\n\r\n")),
+        _subscriber_count(0),
+        _task(nullptr)
   {
+    portMUX_INITIALIZE(&_subscribers_lock);
     _event_group = xEventGroupCreate();
-    if (!_event_group)
+    _part_headers.reset(new char[_part_headers_size]);
+    _subscribers.reset(new httpd_req_t *[config.max_subscribers]);
+    if (!_event_group || !_part_headers || !_subscribers)
     {
       ESP_ERROR_CHECK(ESP_ERR_NO_MEM);
     }
@@ -63,6 +76,18 @@ namespace cjf
 
   multipart_stream::~multipart_stream()
   {
+    if (_task)
+    {
+      vTaskDelete(_task);
+    }
+    if (_part_release)
+    {
+      _part_release(_part_release_ctx);
+    }
+    while (_subscriber_count)
+    {
+      remove_subscriber(0);
+    }
     if (_event_group)
     {
       vEventGroupDelete(_event_group);
@@ -71,19 +96,45 @@ namespace cjf
 
   esp_err_t multipart_stream::write(const char *data, const size_t size, TickType_t ticks_to_wait)
   {
+    return write(data, size, nullptr, nullptr, ticks_to_wait);
+  }
+
+  esp_err_t multipart_stream::write(const char *data, const size_t size, void (*release)(void *ctx), void *release_ctx,
+                                    TickType_t ticks_to_wait)
+  {
+    // Nobody is watching, so there is nothing to wait for
+    if (!subscriber_count())
+    {
+      if (release)
+      {
+        release(release_ctx);
+      }
+      return ESP_OK;
+    }
     // If a timeout occurs while writing a part, there may still be a transfer in
     // progress. We need to wait for the transfer to complete before writing the next part.
     TickType_t start = xTaskGetTickCount();
     if (xEventGroupWaitBits(_event_group, PART_SENT, pdTRUE, pdTRUE, ticks_to_wait) != PART_SENT)
     {
+      if (release)
+      {
+        release(release_ctx);
+      }
       ESP_RETURN_ON_ERROR(ESP_ERR_TIMEOUT, MULTIPART_STREAM_MIDDLEWARE, "Timeout waiting for previous part to be sent");
     }
-    ticks_to_wait -= xTaskGetTickCount() - start;
+    if (ticks_to_wait != portMAX_DELAY)
+    {
+      TickType_t elapsed = xTaskGetTickCount() - start;
+      ticks_to_wait = (elapsed < ticks_to_wait) ? ticks_to_wait - elapsed : 0;
+    }
     _part = reinterpret_cast<const char *>(data);
     _part_size = size;
+    _part_release = release;
+    _part_release_ctx = release_ctx;
     xEventGroupSetBits(_event_group, PART_READY);
     // Wait until the part is sent or a timeout occurs. Do not clear the PART_SENT bit here,
-    // it is used above to check that the previous part has been sent.
+    // it is used above to check that the previous part has been sent. From here on
+    // the sender task releases the part.
     if (xEventGroupWaitBits(_event_group, PART_SENT, pdFALSE, pdTRUE, ticks_to_wait) != PART_SENT)
     {
       ESP_RETURN_ON_ERROR(ESP_ERR_TIMEOUT, MULTIPART_STREAM_MIDDLEWARE, "Timeout waiting for part to be sent");
@@ -96,81 +147,156 @@ namespace cjf
     return write(reinterpret_cast<const char *>(data), size, ticks_to_wait);
   }
 
-  esp_err_t multipart_stream::multipart_stream_handler(httpd_req_t *req, middleware_next_t next)
+  size_t multipart_stream::subscriber_count()
   {
-    auto self = reinterpret_cast<multipart_stream *>(req->user_ctx);
-    esp_err_t res = ESP_OK;
+    taskENTER_CRITICAL(&_subscribers_lock);
+    size_t count = _subscriber_count;
+    taskEXIT_CRITICAL(&_subscribers_lock);
+    return count;
+  }
 
-    if (self->_config.on_stream_start)
+  void multipart_stream::send_part()
+  {
+    int part_headers_len = snprintf(_part_headers.get(), _part_headers_size, "%sContent-Length: %u\r\n\r\n",
+                                    _part_content_type.c_str(),
+                                    (unsigned int)_part_size);
+
+    // Subscribers are only added by the httpd task and only removed here, so
+    // the one at index stays put while it is being sent to.
+    size_t index = 0;
+    while (true)
     {
-      self->_config.on_stream_start(self->_config.ctx);
+      taskENTER_CRITICAL(&_subscribers_lock);
+      httpd_req_t *req = (index < _subscriber_count) ? _subscribers[index] : nullptr;
+      taskEXIT_CRITICAL(&_subscribers_lock);
+      if (!req)
+      {
+        break;
+      }
+
+      esp_err_t res = httpd_resp_send_chunk(req, _part_boundary.c_str(), _part_boundary.size());
+      if (res == ESP_OK)
+      {
+        res = httpd_resp_send_chunk(req, _part_headers.get(), part_headers_len);
+      }
+      if (res == ESP_OK)
+      {
+        res = httpd_resp_send_chunk(req, _part, _part_size);
+      }
+      if (res != ESP_OK)
+      {
+        ESP_LOGI(MULTIPART_STREAM_MIDDLEWARE, "Failed to send part, ending stream");
+        remove_subscriber(index);
+        continue;
+      }
+      index++;
+    }
+
+    int64_t now = esp_timer_get_time();
+    if (_send_time)
+    {
+      uint32_t part_time_ms = (now - _send_time) / 1000;
+      float fps = part_time_ms ? 1000.0 / part_time_ms : 0;
+      uint32_t part_size_kb = _part_size / 1024;
+      ESP_LOGD(MULTIPART_STREAM_MIDDLEWARE, "Part: %luKB %lums (%.1f part/s) to %u subscribers",
+               part_size_kb,
+               part_time_ms,
+               fps,
+               (unsigned int)index);
     }
+    _send_time = now;
+  }
 
-    // Note the start time so we can calculate the frame rate
-    int64_t send_time = esp_timer_get_time();
+  void multipart_stream::remove_subscriber(size_t index)
+  {
+    taskENTER_CRITICAL(&_subscribers_lock);
+    httpd_req_t *req = _subscribers[index];
+    _subscribers[index] = _subscribers[--_subscriber_count];
+    taskEXIT_CRITICAL(&_subscribers_lock);
 
-    ESP_LOGI(MULTIPART_STREAM_MIDDLEWARE, "Setting content type: %s", self->_stream_content_type.c_str());
-    res = httpd_resp_set_type(req, self->_stream_content_type.c_str());
-    ESP_RETURN_ON_ERROR(res, MULTIPART_STREAM_MIDDLEWARE, "Failed to set content type");
+    if (_config.on_stream_end)
+    {
+      _config.on_stream_end(_config.ctx);
+    }
+    // The response can't be finished cleanly, so don't let the socket be reused
+    httpd_sess_trigger_close(req->handle, httpd_req_to_sockfd(req));
+    req_async_handler_complete(req);
+    ESP_LOGI(MULTIPART_STREAM_MIDDLEWARE, "End of stream");
+  }
 
+  void multipart_stream::sender_task(void *arg)
+  {
+    auto self = reinterpret_cast<multipart_stream *>(arg);
     while (true)
     {
-      ESP_LOGI(MULTIPART_STREAM_MIDDLEWARE, "Waiting for part");
-      if (!xEventGroupWaitBits(self->_event_group, PART_READY, pdTRUE, pdTRUE, portMAX_DELAY))
+      if (!(xEventGroupWaitBits(self->_event_group, PART_READY, pdTRUE, pdTRUE, portMAX_DELAY) & PART_READY))
       {
-        ESP_LOGI(MULTIPART_STREAM_MIDDLEWARE, "Part ready timeout");
         continue;
       }
-
-      ESP_LOGI(MULTIPART_STREAM_MIDDLEWARE, "Sending part boundary");
-      res = httpd_resp_send_chunk(req, self->_part_boundary.c_str(), self->_part_boundary.size());
-      if (res != ESP_OK)
+      self->send_part();
+      if (self->_part_release)
       {
-        ESP_LOGE(MULTIPART_STREAM_MIDDLEWARE, "Failed to send boundary");
-        break;
+        self->_part_release(self->_part_release_ctx);
+        self->_part_release = nullptr;
       }
-      ESP_RETURN_ON_ERROR(res, MULTIPART_STREAM_MIDDLEWARE, "Failed to send boundary");
+      xEventGroupSetBits(self->_event_group, PART_SENT);
+    }
+  }
 
-      ESP_LOGI(MULTIPART_STREAM_MIDDLEWARE, "Sending part headers");
-      std::string part_headers =
-          self->_part_content_type +
-          "Content-Length: " + std::to_string(self->_part_size) + "\r\n\r\n";
-      res = httpd_resp_send_chunk(req, part_headers.c_str(), part_headers.size());
-      if (res != ESP_OK)
+  esp_err_t multipart_stream::multipart_stream_handler(httpd_req_t *req, middleware_next_t next)
+  {
+    auto self = reinterpret_cast<multipart_stream *>(req->user_ctx);
+    auto context = request_context::from(req);
+
+    // Streams hold their socket indefinitely, so leave the rest for short requests
+    if (self->subscriber_count() >= self->_config.max_subscribers ||
+        (context && context->begin_stream() != ESP_OK))
+    {
+      httpd_resp_set_status(req, "503 Service Unavailable");
+      httpd_resp_set_hdr(req, "Retry-After", "1");
+      return httpd_resp_sendstr(req, "Too many streams");
+    }
+
+    if (!self->_task &&
+        xTaskCreate(sender_task, "multipart_stream", self->_config.task_stack_size, self,
+                    self->_config.task_priority, &self->_task) != pdPASS)
+    {
+      self->_task = nullptr;
+      ESP_LOGE(MULTIPART_STREAM_MIDDLEWARE, "Failed to create sender task");
+      if (context)
       {
-        ESP_LOGE(MULTIPART_STREAM_MIDDLEWARE, "Failed to send part headers");
-        break;
+        context->end_stream();
       }
+      return httpd_resp_send_500(req);
+    }
 
-      ESP_LOGI(MULTIPART_STREAM_MIDDLEWARE, "Sending part");
-      res = httpd_resp_send_chunk(req, self->_part, self->_part_size);
-      if (res != ESP_OK)
+    // Hand the request over to the sender task so that httpd can move on
+    httpd_req_t *stream_req;
+    esp_err_t ret = req_async_handler_begin(req, &stream_req);
+    if (ret != ESP_OK)
+    {
+      ESP_LOGE(MULTIPART_STREAM_MIDDLEWARE, "Failed to detach stream");
+      if (context)
       {
-        ESP_LOGE(MULTIPART_STREAM_MIDDLEWARE, "Failed to send part");
-        break;
+        context->end_stream();
       }
-
-      int64_t now = esp_timer_get_time();
-      uint32_t part_time_ms = (now - send_time) / 1000;
-      float fps = 1000.0 / part_time_ms;
-      uint32_t part_size_kb = self->_part_size / 1024;
-      send_time = now;
-      ESP_LOGI(MULTIPART_STREAM_MIDDLEWARE, "Part: %luKB %lums (%.1f part/s)",
-               part_size_kb,
-               part_time_ms,
-               fps);
-      xEventGroupSetBits(self->_event_group, PART_SENT);
+      return ret;
     }
 
-    if (self->_config.on_stream_end)
+    ESP_LOGI(MULTIPART_STREAM_MIDDLEWARE, "Setting content type: %s", self->_stream_content_type.c_str());
+    httpd_resp_set_type(stream_req, self->_stream_content_type.c_str());
+
+    if (self->_config.on_stream_start)
     {
-      self->_config.on_stream_end(self->_config.ctx);
+      self->_config.on_stream_start(self->_config.ctx);
     }
 
-    // This must be set so that the next part in a new stream can be sent
-    xEventGroupSetBits(self->_event_group, PART_SENT);
-    ESP_LOGI(MULTIPART_STREAM_MIDDLEWARE, "End of stream");
-    return res;
+    taskENTER_CRITICAL(&self->_subscribers_lock);
+    self->_subscribers[self->_subscriber_count++] = stream_req;
+    size_t count = self->_subscriber_count;
+    taskEXIT_CRITICAL(&self->_subscribers_lock);
+    ESP_LOGI(MULTIPART_STREAM_MIDDLEWARE, "Stream started, %u subscribers", (unsigned int)count);
+    return ESP_OK;
   }
 
 } // namespace cjf
@@ -0,0 +1,71 @@
+#include <cjf/middleware/trace_dump.h>
+#include <cjf/request_context.h>
+#include <cJSON.h>
+#include <esp_http_server.h>
+#include <esp_log.h>
+
+namespace cjf
+{
+
+  const char *TRACE_DUMP_MIDDLEWARE = "middleware:trace_dump";
+
+  static cJSON *trace_to_json(const request_trace_t &trace)
+  {
+    cJSON *json = cJSON_CreateObject();
+    cJSON_AddStringToObject(json, "uri", trace.uri);
+    cJSON_AddStringToObject(json, "method", http_method_str(trace.method));
+    cJSON_AddNumberToObject(json, "start_us", trace.start_us);
+    cJSON_AddNumberToObject(json, "duration_us", trace.end_us - trace.start_us);
+    cJSON_AddStringToObject(json, "result", esp_err_to_name(trace.result));
+    cJSON_AddBoolToObject(json, "truncated", trace.truncated);
+
+    cJSON *hops = cJSON_AddArrayToObject(json, "hops");
+    for (size_t i = 0; i < trace.hop_count; i++)
+    {
+      auto &hop = trace.hops[i];
+      cJSON *item = cJSON_CreateObject();
+      cJSON_AddStringToObject(item, "name", hop.name);
+      cJSON_AddNumberToObject(item, "offset_us", hop.enter_us - trace.start_us);
+      cJSON_AddNumberToObject(item, "duration_us", hop.exit_us - hop.enter_us);
+      cJSON_AddNumberToObject(item, "self_us", trace.self_us(i, trace.end_us));
+      cJSON_AddStringToObject(item, "result", esp_err_to_name(hop.result));
+      cJSON_AddItemToArray(hops, item);
+    }
+    return json;
+  }
+
+  trace_dump::trace_dump(web_server &server)
+      : middleware_t({name, trace_dump_handler, this}), _server(server)
+  {
+  }
+
+  esp_err_t trace_dump::trace_dump_handler(httpd_req_t *req, middleware_next_t next)
+  {
+    auto self = reinterpret_cast<trace_dump *>(req->user_ctx);
+    auto context = request_context::from(req);
+    if (req->method != HTTP_GET || !context)
+    {
+      return next();
+    }
+
+    // Traces are copied out one at a time so the server can keep recording
+    auto trace = context->scratch().make<request_trace_t>();
+    if (!trace)
+    {
+      ESP_LOGE(TRACE_DUMP_MIDDLEWARE, "No scratch space left for a trace");
+      return httpd_resp_send_err(req, HTTPD_500_INTERNAL_SERVER_ERROR, "Out of memory");
+    }
+
+    cJSON *json = cJSON_CreateObject();
+    cJSON *traces = cJSON_AddArrayToObject(json, "traces");
+    for (size_t i = 0; self->_server.trace_at(i, *trace); i++)
+    {
+      cJSON_AddItemToArray(traces, trace_to_json(*trace));
+    }
+    httpd_resp_set_hdr(req, "Cache-Control", "no-store");
+    send_json_response(req, json);
+    cJSON_Delete(json);
+    return ESP_OK;
+  }
+
+} // namespace cjf
@@ -1,14 +1,17 @@
 #include <cjf/mime.h>
+#include <cjf/web_server.h>
 
 #include <esp_err.h>
 #include <esp_http_server.h>
 #include <map>
 #include <string>
+#include <string_view>
 
 namespace cjf
 {
 
-  static std::map<std::string, const char *> MIME_BY_EXT = {
+  // std::less<> allows lookups by string_view without building a std::string
+  static std::map<std::string, const char *, std::less<>> MIME_BY_EXT = {
       {".htm", "text/html"},
       {".html", "text/html"},
       {".css", "text/css"},
@@ -29,9 +32,14 @@ namespace cjf
     MIME_BY_EXT[file_extension] = mime.c_str();
   }
 
-  const char *mime_from_path(const std::string path)
+  const char *mime_from_path(std::string_view path)
   {
-    auto ext = path.substr(path.find_last_of("."));
+    auto dot = path.find_last_of('.');
+    if (dot == std::string_view::npos)
+    {
+      return nullptr;
+    }
+    auto ext = path.substr(dot);
     auto match = MIME_BY_EXT.find(ext);
     if (match != MIME_BY_EXT.end())
     {
@@ -40,14 +48,14 @@ namespace cjf
     return nullptr;
   }
 
-  esp_err_t set_content_type_from_path(httpd_req_t *req, const std::string path)
+  esp_err_t set_content_type_from_path(httpd_req_t *req, std::string_view path)
   {
     auto mime = mime_from_path(path);
     if (!mime)
     {
       mime = MIME_UNKNOWN;
     }
-    return httpd_resp_set_type(req, mime);
+    return resp_set_type(req, mime);
   }
 
   const char *MIME_UNKNOWN = "application/octet-stream";
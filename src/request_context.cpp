@@ -0,0 +1,275 @@
+#include <cjf/request_context.h>
+#include <cjf/web_server.h>
+
+#include <esp_log.h>
+#include <string.h>
+
+namespace cjf
+{
+
+  const char *REQUEST_CONTEXT = "request_context";
+
+  request_context::request_context(web_server *server, size_t arena_size, size_t max_slots,
+                                   size_t max_params, size_t max_query_params)
+      : _server(server),
+        _req(nullptr),
+        _ctx(nullptr),
+        _path_decoded(false),
+        _content_type(nullptr),
+        _response_started(false),
+        _writer(nullptr),
+        _arena(arena_size),
+        _slots(new request_slot_t[max_slots]),
+        _max_slots(max_slots),
+        _slot_count(0),
+        _params(nullptr),
+        _param_count(0),
+        _matched(new uri_param_t[max_params]),
+        _max_params(max_params),
+        _matched_count(0),
+        _query(new uri_param_t[max_query_params]),
+        _max_query_params(max_query_params),
+        _query_count(0),
+        _query_parsed(false)
+  {
+  }
+
+  request_context *request_context::from(httpd_req_t *req)
+  {
+    auto server = reinterpret_cast<web_server *>(httpd_get_global_user_ctx(req->handle));
+    if (!server || server->_context._req != req)
+    {
+      return nullptr;
+    }
+    return &server->_context;
+  }
+
+  esp_err_t request_context::set(const char *key, void *value)
+  {
+    for (size_t i = 0; i < _slot_count; i++)
+    {
+      if (_slots[i].key == key || strcmp(_slots[i].key, key) == 0)
+      {
+        _slots[i].value = value;
+        return ESP_OK;
+      }
+    }
+    if (_slot_count == _max_slots)
+    {
+      return ESP_ERR_NO_MEM;
+    }
+    _slots[_slot_count++] = {key, value};
+    return ESP_OK;
+  }
+
+  void *request_context::get(const char *key) const
+  {
+    for (size_t i = 0; i < _slot_count; i++)
+    {
+      if (_slots[i].key == key || strcmp(_slots[i].key, key) == 0)
+      {
+        return _slots[i].value;
+      }
+    }
+    return nullptr;
+  }
+
+  esp_err_t response_writer::forward_send(response_writer *next, httpd_req_t *req, const char *buf, size_t len)
+  {
+    return next ? next->send(req, buf, len) : httpd_resp_send(req, buf, len);
+  }
+
+  esp_err_t response_writer::forward_send_chunk(response_writer *next, httpd_req_t *req, const char *buf, size_t len)
+  {
+    return next ? next->send_chunk(req, buf, len) : httpd_resp_send_chunk(req, buf, len);
+  }
+
+  response_writer *request_context::set_writer(response_writer *writer)
+  {
+    auto previous = _writer;
+    _writer = writer;
+    return previous;
+  }
+
+  esp_err_t request_context::begin_stream()
+  {
+    return _server->_connections.begin_stream(httpd_req_to_sockfd(_req));
+  }
+
+  void request_context::end_stream()
+  {
+    _server->_connections.end_stream(httpd_req_to_sockfd(_req));
+  }
+
+  std::string_view request_context::decoded_path()
+  {
+    if (!_path_decoded)
+    {
+      _decoded_path = uri_is_encoded(_path, false) ? decode(_path, false) : _path;
+      _path_decoded = true;
+    }
+    return _decoded_path;
+  }
+
+  std::string_view request_context::param(std::string_view name)
+  {
+    for (size_t i = 0; i < _param_count; i++)
+    {
+      auto &param = _params[i];
+      if (param.key == name)
+      {
+        if (param.encoded_value)
+        {
+          param.value = decode(param.value, false);
+          param.encoded_value = false;
+        }
+        return param.value;
+      }
+    }
+    return {};
+  }
+
+  std::optional<std::string_view> request_context::query(std::string_view key)
+  {
+    parse_query();
+    for (size_t i = 0; i < _query_count; i++)
+    {
+      auto &param = _query[i];
+      if (param.encoded_key)
+      {
+        param.key = decode(param.key, true);
+        param.encoded_key = false;
+      }
+      if (param.key == key)
+      {
+        return query_at(i).value;
+      }
+    }
+    return std::nullopt;
+  }
+
+  size_t request_context::query_count()
+  {
+    parse_query();
+    return _query_count;
+  }
+
+  const uri_param_t &request_context::query_at(size_t index)
+  {
+    parse_query();
+    auto &param = _query[index];
+    if (param.encoded_key)
+    {
+      param.key = decode(param.key, true);
+      param.encoded_key = false;
+    }
+    if (param.encoded_value)
+    {
+      param.value = decode(param.value, true);
+      param.encoded_value = false;
+    }
+    return param;
+  }
+
+  std::string_view request_context::decode(std::string_view str, bool plus_as_space)
+  {
+    char *decoded = _arena.allocate<char>(str.size());
+    if (!decoded)
+    {
+      ESP_LOGW(REQUEST_CONTEXT, "Request arena exhausted, returning undecoded value");
+      return str;
+    }
+    return std::string_view(decoded, uri_decode(str, decoded, plus_as_space));
+  }
+
+  void request_context::parse_query()
+  {
+    if (!_query_parsed)
+    {
+      _query_count = uri_parse_query(_query_string, _query.get(), _max_query_params);
+      _query_parsed = true;
+    }
+  }
+
+  bool request_context::match(const char *uri_template)
+  {
+    return uri_template_match(uri_template, _path, _matched.get(), _max_params, &_matched_count);
+  }
+
+  request_context::hop_t request_context::enter(void *ctx)
+  {
+    hop_t outer = {_ctx, _params, _param_count};
+    _ctx = ctx;
+    _params = nullptr;
+    _param_count = 0;
+    if (_matched_count)
+    {
+      // Give the hop its own copy so the parameters survive later matches
+      _params = _arena.allocate<uri_param_t>(_matched_count);
+      if (_params)
+      {
+        memcpy(_params, _matched.get(), sizeof(uri_param_t) * _matched_count);
+        _param_count = _matched_count;
+      }
+      else
+      {
+        ESP_LOGW(REQUEST_CONTEXT, "Request arena exhausted, dropping route parameters");
+      }
+    }
+    return outer;
+  }
+
+  void request_context::leave(const hop_t &hop)
+  {
+    _ctx = hop.ctx;
+    _params = hop.params;
+    _param_count = hop.param_count;
+  }
+
+  void request_context::begin(httpd_req_t *req)
+  {
+    _req = req;
+    _ctx = nullptr;
+    std::string_view uri(req->uri);
+    size_t path_end = uri.find_first_of("?#");
+    _path = uri.substr(0, path_end);
+    _query_string = {};
+    if (path_end != std::string_view::npos && uri[path_end] == '?')
+    {
+      _query_string = uri.substr(path_end + 1);
+      _query_string = _query_string.substr(0, _query_string.find('#'));
+    }
+    _path_decoded = false;
+    _query_parsed = false;
+    _content_type = nullptr;
+    _response_started = false;
+    _writer = nullptr;
+  }
+
+  void request_context::start_response()
+  {
+    if (!_response_started)
+    {
+      _response_started = true;
+      _server->_trace_server_timing(_req);
+    }
+  }
+
+  void request_context::end()
+  {
+    _req = nullptr;
+    _ctx = nullptr;
+    _path = {};
+    _decoded_path = {};
+    _query_string = {};
+    _content_type = nullptr;
+    _writer = nullptr;
+    _params = nullptr;
+    _param_count = 0;
+    _matched_count = 0;
+    _query_count = 0;
+    _slot_count = 0;
+    _arena.reset();
+  }
+
+} // namespace cjf
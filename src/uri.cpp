@@ -0,0 +1,175 @@
+#include <cjf/uri.h>
+
+namespace cjf
+{
+
+  static int hex_value(char c)
+  {
+    if (c >= '0' && c <= '9')
+    {
+      return c - '0';
+    }
+    if (c >= 'a' && c <= 'f')
+    {
+      return c - 'a' + 10;
+    }
+    if (c >= 'A' && c <= 'F')
+    {
+      return c - 'A' + 10;
+    }
+    return -1;
+  }
+
+  static bool capture(uri_param_t *params, size_t max_params, size_t *param_count,
+                      std::string_view key, std::string_view value)
+  {
+    if (*param_count == max_params)
+    {
+      return false;
+    }
+    params[(*param_count)++] = {key, value, false, uri_is_encoded(value, false)};
+    return true;
+  }
+
+  bool uri_template_match(std::string_view uri_template, std::string_view path,
+                          uri_param_t *params, size_t max_params, size_t *param_count)
+  {
+    size_t t = 0;
+    size_t p = 0;
+    *param_count = 0;
+
+    while (t < uri_template.size())
+    {
+      char c = uri_template[t];
+
+      // A trailing '*' matches whatever is left of the path. Capturing it is
+      // best effort so that catch-all routes match even without spare params.
+      if (c == '*' && t + 1 == uri_template.size())
+      {
+        capture(params, max_params, param_count, "*", path.substr(p));
+        return true;
+      }
+
+      // ":name" at the start of a segment captures the whole segment
+      if (c == ':' && (t == 0 || uri_template[t - 1] == '/'))
+      {
+        size_t name_end = uri_template.find('/', t);
+        if (name_end == std::string_view::npos)
+        {
+          name_end = uri_template.size();
+        }
+        size_t value_end = path.find('/', p);
+        if (value_end == std::string_view::npos)
+        {
+          value_end = path.size();
+        }
+        if (value_end == p ||
+            !capture(params, max_params, param_count,
+                     uri_template.substr(t + 1, name_end - t - 1),
+                     path.substr(p, value_end - p)))
+        {
+          return false;
+        }
+        t = name_end;
+        p = value_end;
+        continue;
+      }
+
+      // "x?", "x?*" or "x*?" at the end of the template makes x optional, but
+      // only if the path ends or carries on with x. With '*' anything may follow.
+      size_t rest = uri_template.size() - t;
+      bool optional = (rest == 2 && uri_template[t + 1] == '?') ||
+                      (rest == 3 && ((uri_template[t + 1] == '?' && uri_template[t + 2] == '*') ||
+                                     (uri_template[t + 1] == '*' && uri_template[t + 2] == '?')));
+      if (optional)
+      {
+        if (p < path.size() && path[p] == c)
+        {
+          p++;
+        }
+        else if (p != path.size())
+        {
+          return false;
+        }
+        if (rest == 3)
+        {
+          capture(params, max_params, param_count, "*", path.substr(p));
+          return true;
+        }
+        return p == path.size();
+      }
+
+      if (p == path.size() || path[p] != c)
+      {
+        return false;
+      }
+      t++;
+      p++;
+    }
+
+    return p == path.size();
+  }
+
+  size_t uri_template_param_count(std::string_view uri_template)
+  {
+    size_t count = 0;
+    for (size_t i = 0; i < uri_template.size(); i++)
+    {
+      if (uri_template[i] == ':' && (i == 0 || uri_template[i - 1] == '/'))
+      {
+        count++;
+      }
+    }
+    return count;
+  }
+
+  size_t uri_parse_query(std::string_view query, uri_param_t *params, size_t max_params)
+  {
+    size_t count = 0;
+    size_t start = 0;
+    while (start < query.size() && count < max_params)
+    {
+      size_t end = query.find('&', start);
+      if (end == std::string_view::npos)
+      {
+        end = query.size();
+      }
+      auto pair = query.substr(start, end - start);
+      if (!pair.empty())
+      {
+        size_t eq = pair.find('=');
+        auto key = pair.substr(0, eq);
+        auto value = (eq == std::string_view::npos) ? std::string_view() : pair.substr(eq + 1);
+        params[count++] = {key, value, uri_is_encoded(key, true), uri_is_encoded(value, true)};
+      }
+      start = end + 1;
+    }
+    return count;
+  }
+
+  bool uri_is_encoded(std::string_view str, bool plus_as_space)
+  {
+    return str.find_first_of(plus_as_space ? "%+" : "%") != std::string_view::npos;
+  }
+
+  size_t uri_decode(std::string_view str, char *out, bool plus_as_space)
+  {
+    size_t len = 0;
+    for (size_t i = 0; i < str.size(); i++)
+    {
+      char c = str[i];
+      if (c == '%' && i + 2 < str.size() && hex_value(str[i + 1]) >= 0 && hex_value(str[i + 2]) >= 0)
+      {
+        c = (char)((hex_value(str[i + 1]) << 4) | hex_value(str[i + 2]));
+        i += 2;
+      }
+      else if (c == '+' && plus_as_space)
+      {
+        c = ' ';
+      }
+      out[len++] = c;
+    }
+    return len;
+  }
+
+} // namespace cjf
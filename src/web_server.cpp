@@ -1,23 +1,58 @@
 #include <cjf/web_server.h>
 
+#include <algorithm>
 #include <esp_http_server.h>
 #include <esp_log.h>
+#include <esp_timer.h>
 #include <FreeRTOS.h>
 #include <freertos/task.h>
+#include <unistd.h>
 
 namespace cjf
 {
 
   const char *WEB_SERVER = "web_server";
 
-  web_server::web_server(const httpd_config_t &config)
+  web_server::web_server(const httpd_config_t &config, const web_server_config_t &options)
       : _config(config),
-        _server(nullptr)
+        _options(options),
+        _server(nullptr),
+        _context(this, options.arena_size, options.max_request_slots,
+                 options.max_route_params, options.max_query_params),
+        _connections(config.max_open_sockets,
+                     {options.idle_timeout_ms, options.max_streams, options.max_idle_sockets}),
+        _open_fn(config.open_fn),
+        _close_fn(config.close_fn),
+        _global_user_ctx(config.global_user_ctx),
+        _global_user_ctx_free_fn(config.global_user_ctx_free_fn),
+        _traces(options.trace_depth ? new request_trace_t[options.trace_depth] : nullptr),
+        _trace_count(0),
+        _trace_next(0),
+        _trace({})
   {
+    portMUX_INITIALIZE(&_trace_lock);
+
     // Use a custom uri match function so that all uris are handled by the
     // internal _req_handler. This allows us to run multiple middleware handlers
     // for a given request.
     _config.uri_match_fn = uri_match_any;
+    // The server is stored as the global user context so that the request
+    // context can be found from any httpd_req_t. The caller's context is kept
+    // and released on stop the way httpd would have.
+    _config.global_user_ctx = this;
+    _config.global_user_ctx_free_fn = _free_global_user_ctx;
+    if (_options.manage_connections)
+    {
+      // Sessions are tracked so that idle sockets can be closed before httpd
+      // runs out. httpd's own LRU purge would also close sockets carrying streams.
+      if (_config.lru_purge_enable)
+      {
+        ESP_LOGW(WEB_SERVER, "Disabling lru_purge_enable, idle sockets are evicted by the connection manager");
+      }
+      _config.open_fn = _on_open;
+      _config.close_fn = _on_close;
+      _config.lru_purge_enable = false;
+    }
   }
 
   web_server::~web_server()
@@ -41,6 +76,15 @@ namespace cjf
       ESP_LOGI(WEB_SERVER, "Web server listening on port: %d", _config.server_port);
       _register_handler_for_method(HTTP_GET);
       _register_handler_for_method(HTTP_POST);
+      ret = _options.manage_connections ? _connections.start(_server) : ESP_OK;
+      if (ret != ESP_OK)
+      {
+        ESP_LOGE(WEB_SERVER, "Failed to start connection manager");
+        _connections.stop();
+        httpd_stop(_server);
+        _connections.detach();
+        _server = nullptr;
+      }
     }
     return ret;
   }
@@ -48,6 +92,7 @@ namespace cjf
   esp_err_t web_server::stop()
   {
     ESP_LOGI(WEB_SERVER, "Stopping web server");
+    _connections.stop();
     esp_err_t ret = httpd_stop(_server);
     if (ret != ESP_OK)
     {
@@ -55,6 +100,7 @@ namespace cjf
     }
     else
     {
+      _connections.detach();
       _server = nullptr;
       ESP_LOGI(WEB_SERVER, "Web server stopped");
     }
@@ -75,6 +121,11 @@ namespace cjf
   {
     const char* name = (middleware.name) ? middleware.name : "anonymous";
     ESP_LOGI(WEB_SERVER, "Using %s middleware for %s", name, path);
+    if (uri_template_param_count(path) > _options.max_route_params)
+    {
+      ESP_LOGE(WEB_SERVER, "%s captures more than %u parameters and will never match",
+               path, (unsigned int)_options.max_route_params);
+    }
     _routes.push_back({path, middleware});
   }
 
@@ -83,6 +134,33 @@ namespace cjf
     use(path, {nullptr, handler, nullptr});
   }
 
+  connection_stats_t web_server::connection_stats()
+  {
+    return _connections.stats();
+  }
+
+  size_t web_server::trace_count()
+  {
+    taskENTER_CRITICAL(&_trace_lock);
+    size_t count = _trace_count;
+    taskEXIT_CRITICAL(&_trace_lock);
+    return count;
+  }
+
+  bool web_server::trace_at(size_t index, request_trace_t &trace)
+  {
+    bool found = false;
+    taskENTER_CRITICAL(&_trace_lock);
+    if (index < _trace_count)
+    {
+      size_t oldest = _trace_next + _options.trace_depth - _trace_count;
+      trace = _traces[(oldest + index) % _options.trace_depth];
+      found = true;
+    }
+    taskEXIT_CRITICAL(&_trace_lock);
+    return found;
+  }
+
   esp_err_t web_server::_register_handler_for_method(const httpd_method_t method)
   {
     httpd_uri_t uri = {
@@ -99,30 +177,196 @@ namespace cjf
   esp_err_t web_server::_req_handler(httpd_req_t *req)
   {
     auto server = reinterpret_cast<web_server *>(req->user_ctx);
-    auto routes = server->_routes;
-    auto route = routes.begin();
-    if (route == routes.end())
+    auto &routes = server->_routes;
+    if (routes.empty())
     {
       // No middleware registered
       return httpd_resp_send_404(req);
     }
-    middleware_next_t next = [&next, &req, &routes, &route]() -> esp_err_t
+
+    // Everything the chain needs is kept here so that next only captures a
+    // single pointer and fits in std::function's inline storage.
+    struct
     {
-      while (route != routes.end() && !httpd_uri_match_wildcard(route->uri, req->uri, strlen(route->uri)))
+      httpd_req_t *req;
+      web_server *server;
+      request_context *context;
+      std::list<middleware_uri_t>::iterator route;
+      std::list<middleware_uri_t>::iterator end;
+      middleware_next_t next;
+    } chain = {req, server, &server->_context, routes.begin(), routes.end(), nullptr};
+
+    chain.next = [&chain]() -> esp_err_t
+    {
+      auto req = chain.req;
+      while (chain.route != chain.end && !chain.context->match(chain.route->uri))
       {
-        route++;
+        chain.route++;
       }
-      if (route == routes.end())
+      if (chain.route == chain.end)
       {
         return ESP_OK;
       }
-      const char* name = (route->middleware.name) ? route->middleware.name : "anonymous";
+      const char* name = (chain.route->middleware.name) ? chain.route->middleware.name : "anonymous";
       ESP_LOGI(WEB_SERVER, "Running %s middleware for %s", name, req->uri);
-      vTaskDelay(pdMS_TO_TICKS(100));
+      auto route = chain.route++;
       req->user_ctx = route->middleware.ctx;
-      return (route++)->middleware.handler(req, next);
+      auto outer = chain.context->enter(route->middleware.ctx);
+      int hop = chain.server->_trace_enter(name);
+      esp_err_t ret = route->middleware.handler(req, chain.next);
+      chain.server->_trace_exit(hop, ret);
+      // Once downstream middleware returns the context belongs to the caller again
+      chain.context->leave(outer);
+      return ret;
     };
-    return next();
+
+    int sockfd = httpd_req_to_sockfd(req);
+    server->_connections.request_started(sockfd);
+    server->_context.begin(req);
+    server->_trace_begin(req);
+    esp_err_t ret = chain.next();
+    server->_trace_end(ret);
+    server->_context.end();
+    server->_connections.request_finished(sockfd);
+    return ret;
+  }
+
+  void web_server::_free_global_user_ctx(void *ctx)
+  {
+    auto server = reinterpret_cast<web_server *>(ctx);
+    if (!server->_global_user_ctx)
+    {
+      return;
+    }
+    if (server->_global_user_ctx_free_fn)
+    {
+      server->_global_user_ctx_free_fn(server->_global_user_ctx);
+    }
+    else
+    {
+      free(server->_global_user_ctx);
+    }
+    server->_global_user_ctx = nullptr;
+  }
+
+  esp_err_t web_server::_on_open(httpd_handle_t hd, int sockfd)
+  {
+    auto server = reinterpret_cast<web_server *>(httpd_get_global_user_ctx(hd));
+    if (server->_open_fn)
+    {
+      esp_err_t ret = server->_open_fn(hd, sockfd);
+      if (ret != ESP_OK)
+      {
+        return ret;
+      }
+    }
+    return server->_connections.on_open(sockfd);
+  }
+
+  void web_server::_on_close(httpd_handle_t hd, int sockfd)
+  {
+    auto server = reinterpret_cast<web_server *>(httpd_get_global_user_ctx(hd));
+    server->_connections.on_close(sockfd);
+    // httpd leaves closing the socket to close_fn when one is set
+    if (server->_close_fn)
+    {
+      server->_close_fn(hd, sockfd);
+    }
+    else
+    {
+      close(sockfd);
+    }
+  }
+
+  void web_server::_trace_begin(httpd_req_t *req)
+  {
+    if (!_traces)
+    {
+      return;
+    }
+    auto path = _context.path();
+    size_t size = std::min(path.size(), sizeof(_trace.uri) - 1);
+    memcpy(_trace.uri, path.data(), size);
+    _trace.uri[size] = '\0';
+    _trace.method = static_cast<httpd_method_t>(req->method);
+    _trace.start_us = esp_timer_get_time();
+    _trace.end_us = 0;
+    _trace.result = ESP_OK;
+    _trace.truncated = false;
+    _trace.hop_count = 0;
+  }
+
+  void web_server::_trace_end(esp_err_t result)
+  {
+    if (!_traces)
+    {
+      return;
+    }
+    _trace.end_us = esp_timer_get_time();
+    _trace.result = result;
+    taskENTER_CRITICAL(&_trace_lock);
+    _traces[_trace_next] = _trace;
+    _trace_next = (_trace_next + 1) % _options.trace_depth;
+    _trace_count = std::min(_trace_count + 1, _options.trace_depth);
+    taskEXIT_CRITICAL(&_trace_lock);
+  }
+
+  int web_server::_trace_enter(const char *name)
+  {
+    if (!_traces)
+    {
+      return -1;
+    }
+    if (_trace.hop_count == REQUEST_TRACE_MAX_HOPS)
+    {
+      _trace.truncated = true;
+      return -1;
+    }
+    _trace.hops[_trace.hop_count] = {name, esp_timer_get_time(), 0, ESP_OK};
+    return _trace.hop_count++;
+  }
+
+  void web_server::_trace_exit(int hop, esp_err_t result)
+  {
+    if (hop < 0)
+    {
+      return;
+    }
+    _trace.hops[hop].exit_us = esp_timer_get_time();
+    _trace.hops[hop].result = result;
+  }
+
+  void web_server::_trace_server_timing(httpd_req_t *req)
+  {
+    if (!_traces || !_options.server_timing || !_trace.hop_count)
+    {
+      return;
+    }
+    // Only the time spent up to the first byte of the response can be
+    // reported, as the header goes out with it.
+    int64_t now = esp_timer_get_time();
+    size_t size = 1;
+    for (size_t i = 0; i < _trace.hop_count; i++)
+    {
+      size += strlen(_trace.hops[i].name) + sizeof(";dur=4294967.295, ");
+    }
+    char *value = _context.scratch().allocate<char>(size);
+    if (!value)
+    {
+      ESP_LOGW(WEB_SERVER, "No scratch space left for Server-Timing");
+      return;
+    }
+
+    size_t used = 0;
+    for (size_t i = 0; i < _trace.hop_count; i++)
+    {
+      auto us = static_cast<uint32_t>(_trace.self_us(i, now));
+      used += snprintf(value + used, size - used, "%s%s;dur=%u.%03u", i ? ", " : "",
+                       _trace.hops[i].name, (unsigned int)(us / 1000), (unsigned int)(us % 1000));
+    }
+    // httpd keeps a pointer to the value, which lives in the arena until the
+    // request completes.
+    httpd_resp_set_hdr(req, "Server-Timing", value);
   }
 
   bool web_server::uri_match_any(const char *uri_template, const char *uri_to_match, size_t match_upto)
@@ -130,12 +374,70 @@ namespace cjf
     return true;
   }
 
+  esp_err_t resp_set_type(httpd_req_t *req, const char *type)
+  {
+    auto context = request_context::from(req);
+    if (context)
+    {
+      context->_content_type = type;
+    }
+    return httpd_resp_set_type(req, type);
+  }
+
+  esp_err_t resp_send(httpd_req_t *req, const char *buf, ssize_t len)
+  {
+    size_t size = (len == HTTPD_RESP_USE_STRLEN) ? (buf ? strlen(buf) : 0) : len;
+    auto context = request_context::from(req);
+    if (!context)
+    {
+      return httpd_resp_send(req, buf, size);
+    }
+    context->start_response();
+    return response_writer::forward_send(context->_writer, req, buf, size);
+  }
+
+  esp_err_t resp_send_chunk(httpd_req_t *req, const char *buf, ssize_t len)
+  {
+    size_t size = (len == HTTPD_RESP_USE_STRLEN || !buf) ? (buf ? strlen(buf) : 0) : len;
+    auto context = request_context::from(req);
+    if (!context)
+    {
+      return httpd_resp_send_chunk(req, buf, size);
+    }
+    context->start_response();
+    return response_writer::forward_send_chunk(context->_writer, req, buf, size);
+  }
+
+  esp_err_t req_async_handler_begin(httpd_req_t *req, httpd_req_t **async_req)
+  {
+    auto context = request_context::from(req);
+    esp_err_t ret = httpd_req_async_handler_begin(req, async_req);
+    if (ret == ESP_OK && context)
+    {
+      context->server()->_connections.hold(httpd_req_to_sockfd(req));
+    }
+    return ret;
+  }
+
+  esp_err_t req_async_handler_complete(httpd_req_t *req)
+  {
+    // Only requests detached by a web_server get here, so the global ctx is one
+    auto server = reinterpret_cast<web_server *>(httpd_get_global_user_ctx(req->handle));
+    int sockfd = httpd_req_to_sockfd(req);
+    esp_err_t ret = httpd_req_async_handler_complete(req);
+    if (server)
+    {
+      server->_connections.release(sockfd);
+    }
+    return ret;
+  }
+
   esp_err_t send_json_response(httpd_req_t *req, cJSON *json)
   {
     char *json_str = cJSON_PrintUnformatted(json);
     // TODO: Fix error handling
-    httpd_resp_set_type(req, "application/json");
-    httpd_resp_sendstr(req, json_str);
+    resp_set_type(req, "application/json");
+    resp_sendstr(req, json_str);
     free(json_str);
     return ESP_OK;
   }
@@ -0,0 +1,94 @@
+#include <cjf/middleware/compress_responses.h>
+#include <cjf/middleware/files.h>
+#include <cjf/middleware/multipart_stream.h>
+#include <cjf/middleware/not_found.h>
+#include <cjf/middleware/trace_dump.h>
+#include <cjf/request_context.h>
+#include <cjf/web_server.h>
+
+#include <cJSON.h>
+#include <esp_log.h>
+#include <esp_timer.h>
+#include <freertos/FreeRTOS.h>
+#include <freertos/task.h>
+#include <stdio.h>
+#include <string>
+#include <sys/stat.h>
+
+using namespace cjf;
+
+static const char *HOST_BENCH = "host_bench";
+static const char *WWW = "/tmp/host_bench_www";
+
+// Roughly the size of a VGA JPEG
+static const size_t FRAME_SIZE = 24 * 1024;
+static const uint32_t FRAME_INTERVAL_MS = 33;
+
+static void write_fixture(const char *name, size_t size, char fill)
+{
+  std::string path = std::string(WWW) + "/" + name;
+  FILE *fd = fopen(path.c_str(), "w");
+  if (!fd)
+  {
+    ESP_LOGE(HOST_BENCH, "Failed to create %s", path.c_str());
+    return;
+  }
+  std::string contents(size, fill);
+  fwrite(contents.data(), 1, contents.size(), fd);
+  fclose(fd);
+}
+
+static void frame_task(void *arg)
+{
+  auto stream = reinterpret_cast<multipart_stream *>(arg);
+  static uint8_t frame[FRAME_SIZE];
+  uint32_t count = 0;
+  while (true)
+  {
+    frame[0] = count++;
+    // Don't block when nobody is subscribed
+    stream->write(frame, sizeof(frame), pdMS_TO_TICKS(FRAME_INTERVAL_MS));
+    vTaskDelay(pdMS_TO_TICKS(FRAME_INTERVAL_MS));
+  }
+}
+
+extern "C" void app_main(void)
+{
+  mkdir(WWW, 0755);
+  write_fixture("index.html", 2 * 1024, 'h');
+  write_fixture("data.json", 32 * 1024, ' ');
+
+  static multipart_stream stream({.boundary = "FRAME", .part_content_type = "image/jpeg"});
+  static get_files_from_storage files({.base_path = WWW,
+                                       .max_path_size = 255,
+                                       .index_filename = "index.html",
+                                       .cache_control = nullptr,
+                                       .chunk_size = 1024});
+  static not_found fallback;
+  static compress_responses compression;
+
+  // Port 80 needs root on the host, and loadgen defaults to 8080
+  httpd_config_t config = HTTPD_DEFAULT_CONFIG();
+  config.server_port = 8080;
+  static web_server server(config, {.trace_depth = 16});
+  static trace_dump traces(server);
+  server.use("/debug/traces", traces);
+  server.use(compression);
+  server.use("/api/devices/:id", [](httpd_req_t *req, middleware_next_t next) -> esp_err_t
+             {
+               auto context = request_context::from(req);
+               std::string id(context->param("id"));
+               cJSON *json = cJSON_CreateObject();
+               cJSON_AddStringToObject(json, "id", id.c_str());
+               cJSON_AddNumberToObject(json, "uptime_us", esp_timer_get_time());
+               send_json_response(req, json);
+               cJSON_Delete(json);
+               return ESP_OK;
+             });
+  server.use("/stream", stream);
+  server.use(files);
+  server.use(fallback);
+  ESP_ERROR_CHECK(server.start());
+
+  xTaskCreate(frame_task, "frames", 4096, &stream, 5, NULL);
+}
@@ -0,0 +1,103 @@
+#include "check.h"
+
+#include <cjf/arena.h>
+
+#include <string.h>
+
+using namespace cjf;
+
+static bool aligned(const void *ptr, size_t align)
+{
+  return (reinterpret_cast<uintptr_t>(ptr) & (align - 1)) == 0;
+}
+
+static void test_alignment()
+{
+  arena a(256);
+
+  auto c = a.allocate<char>(1);
+  auto i = a.allocate<uint32_t>();
+  auto d = a.allocate<double>();
+  auto p = a.allocate(1);
+  CHECK(c && i && d && p);
+  CHECK(aligned(i, alignof(uint32_t)));
+  CHECK(aligned(d, alignof(double)));
+  CHECK(aligned(p, alignof(max_align_t)));
+  CHECK(reinterpret_cast<uint8_t *>(i) > reinterpret_cast<uint8_t *>(c));
+
+  struct point
+  {
+    int x;
+    int y;
+  };
+  auto pt = a.make<point>(point{1, 2});
+  CHECK(pt && pt->x == 1 && pt->y == 2 && aligned(pt, alignof(point)));
+}
+
+static void test_exhaustion()
+{
+  arena a(16);
+
+  CHECK(a.allocate(16, 1));
+  CHECK(a.available() == 0);
+  CHECK(!a.allocate(1, 1));
+  // A zero-sized allocation at the end still fits
+  CHECK(a.allocate(0, 1));
+
+  a.reset();
+  CHECK(a.used() == 0 && a.available() == 16);
+  CHECK(a.allocate(15, 1));
+  // Alignment padding counts against the capacity
+  CHECK(!a.allocate<uint32_t>());
+  CHECK(a.used() == 15);
+  CHECK(!a.allocate(SIZE_MAX, 1));
+
+  arena empty(0);
+  CHECK(!empty.allocate(1, 1));
+  CHECK(!empty.strdup("x"));
+}
+
+static void test_strings()
+{
+  arena a(16);
+
+  auto s = a.strdup("hello");
+  CHECK(s && strcmp(s, "hello") == 0);
+  CHECK(a.used() == 6);
+
+  auto f = a.format("%d-%s", 42, "ab");
+  CHECK(f && strcmp(f, "42-ab") == 0);
+  CHECK(a.used() == 12);
+
+  // 4 bytes left: "abc" fits with its terminator, "abcd" doesn't and must
+  // leave the arena untouched
+  CHECK(!a.format("%s", "abcd"));
+  CHECK(a.used() == 12);
+  auto g = a.format("%s", "abc");
+  CHECK(g && strcmp(g, "abc") == 0);
+  CHECK(a.available() == 0);
+  CHECK(!a.format("%s", ""));
+}
+
+static void test_high_water()
+{
+  arena a(64);
+
+  a.allocate(40, 1);
+  a.reset();
+  a.allocate(10, 1);
+  CHECK(a.used() == 10);
+  CHECK(a.high_water() == 40);
+  a.allocate(50, 1);
+  CHECK(a.high_water() == 60);
+  CHECK(a.capacity() == 64);
+}
+
+int main()
+{
+  test_alignment();
+  test_exhaustion();
+  test_strings();
+  test_high_water();
+  return check_failures;
+}
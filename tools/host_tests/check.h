@@ -0,0 +1,20 @@
+#ifndef A8B41E7C_3D92_4F6B_B1E0_5C27D9F3A864
+#define A8B41E7C_3D92_4F6B_B1E0_5C27D9F3A864
+
+#include <stdio.h>
+
+// Failed checks are counted rather than aborting so that one run reports
+// every failure. main returns the count.
+static int check_failures = 0;
+
+#define CHECK(expr)                                                  \
+  do                                                                 \
+  {                                                                  \
+    if (!(expr))                                                     \
+    {                                                                \
+      fprintf(stderr, "%s:%d: CHECK(%s) failed\n", __FILE__, __LINE__, #expr); \
+      check_failures++;                                              \
+    }                                                                \
+  } while (0)
+
+#endif /* A8B41E7C_3D92_4F6B_B1E0_5C27D9F3A864 */
@@ -0,0 +1,26 @@
+#ifndef F2A3C6D1_5B8E_4E07_9C4A_8D1F6B2E7A53
+#define F2A3C6D1_5B8E_4E07_9C4A_8D1F6B2E7A53
+
+#include <stdio.h>
+#include <stdlib.h>
+
+// Just enough of esp_err.h for the host tests
+
+typedef int esp_err_t;
+
+#define ESP_OK 0
+#define ESP_FAIL -1
+#define ESP_ERR_NO_MEM 0x101
+
+#define ESP_ERROR_CHECK(x)                                      \
+  do                                                            \
+  {                                                             \
+    esp_err_t err_rc_ = (x);                                    \
+    if (err_rc_ != ESP_OK)                                      \
+    {                                                           \
+      fprintf(stderr, "ESP_ERROR_CHECK failed: 0x%x\n", err_rc_); \
+      abort();                                                  \
+    }                                                           \
+  } while (0)
+
+#endif /* F2A3C6D1_5B8E_4E07_9C4A_8D1F6B2E7A53 */
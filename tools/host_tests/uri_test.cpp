@@ -0,0 +1,178 @@
+#include "check.h"
+
+#include <cjf/uri.h>
+
+#include <string.h>
+#include <string>
+
+using namespace cjf;
+
+// httpd_uri_match_wildcard from esp_http_server, which route templates
+// without named segments have to agree with.
+static bool idf_uri_match_wildcard(const char *uri_template, const char *uri, size_t len)
+{
+  const size_t tpl_len = strlen(uri_template);
+  size_t exact_match_chars = tpl_len;
+
+  const char last = (tpl_len > 0 ? uri_template[tpl_len - 1] : 0);
+  const char prevlast = (tpl_len > 1 ? uri_template[tpl_len - 2] : 0);
+  const bool asterisk = last == '*' || (prevlast == '*' && last == '?');
+  const bool quest = last == '?' || (prevlast == '?' && last == '*');
+
+  if (exact_match_chars < (size_t)(asterisk + quest * 2))
+  {
+    return false;
+  }
+  exact_match_chars -= asterisk + quest * 2;
+  if (len < exact_match_chars)
+  {
+    return false;
+  }
+
+  if (!quest)
+  {
+    if (!asterisk && len != exact_match_chars)
+    {
+      return false;
+    }
+    return strncmp(uri_template, uri, exact_match_chars) == 0;
+  }
+  if (len > exact_match_chars && uri_template[exact_match_chars] != uri[exact_match_chars])
+  {
+    return false;
+  }
+  if (strncmp(uri_template, uri, exact_match_chars) != 0)
+  {
+    return false;
+  }
+  return asterisk || len <= exact_match_chars + 1;
+}
+
+static bool match(const char *uri_template, const char *path)
+{
+  uri_param_t params[4];
+  size_t count;
+  return uri_template_match(uri_template, path, params, 4, &count);
+}
+
+static void test_wildcard_compatibility()
+{
+  const char *templates[] = {
+      "*", "/*", "/", "/?", "/a", "/ab", "/api", "/api/",
+      "/api/*", "/api/?", "/api/?*", "/api/*?", "/api*",
+      "/a?b", "/a*/b", "?"};
+  const char *paths[] = {
+      "", "/", "/a", "/ab", "/abc", "/a?b", "/a*/b", "/api", "/api/",
+      "/apix", "/api/x", "/api/x/y", "/api//"};
+
+  for (auto uri_template : templates)
+  {
+    for (auto path : paths)
+    {
+      bool expected = idf_uri_match_wildcard(uri_template, path, strlen(path));
+      if (match(uri_template, path) != expected)
+      {
+        fprintf(stderr, "\"%s\" vs \"%s\": expected %s\n", uri_template, path, expected ? "match" : "no match");
+        check_failures++;
+      }
+    }
+  }
+}
+
+static void test_named_segments()
+{
+  uri_param_t params[4];
+  size_t count;
+
+  CHECK(uri_template_match("/api/devices/:id/*", "/api/devices/42/foo/bar", params, 4, &count));
+  CHECK(count == 2);
+  CHECK(params[0].key == "id" && params[0].value == "42");
+  CHECK(params[1].key == "*" && params[1].value == "foo/bar");
+
+  CHECK(uri_template_match("/:a/:b", "/x/y", params, 4, &count));
+  CHECK(count == 2 && params[1].value == "y");
+
+  // Named segments never match an empty segment
+  CHECK(!uri_template_match("/api/devices/:id", "/api/devices/", params, 4, &count));
+  CHECK(!uri_template_match("/api/devices/:id", "/api/devices/1/2", params, 4, &count));
+  // ':' is only special at the start of a segment
+  CHECK(uri_template_match("/a:b", "/a:b", params, 4, &count));
+  CHECK(count == 0);
+
+  CHECK(uri_template_match("/files/:name", "/files/a%20b", params, 4, &count));
+  CHECK(params[0].encoded_value);
+}
+
+static void test_params_exhausted()
+{
+  uri_param_t params[1];
+  size_t count;
+
+  // A named segment that can't be captured fails the match...
+  CHECK(!uri_template_match("/:a/:b", "/x/y", params, 1, &count));
+  // ...but a trailing '*' still matches, uncaptured
+  CHECK(uri_template_match("/:a/*", "/x/y/z", params, 1, &count));
+  CHECK(count == 1 && params[0].value == "x");
+  CHECK(uri_template_match("/*", "/x", nullptr, 0, &count));
+  CHECK(count == 0);
+  CHECK(uri_template_match("/api/?*", "/api/x", nullptr, 0, &count));
+  CHECK(count == 0);
+
+  CHECK(uri_template_param_count("/:a/b/:c/*") == 2);
+  CHECK(uri_template_param_count("/a:b") == 0);
+}
+
+static void test_parse_query()
+{
+  uri_param_t params[4];
+
+  CHECK(uri_parse_query("", params, 4) == 0);
+  CHECK(uri_parse_query("&&", params, 4) == 0);
+
+  CHECK(uri_parse_query("a=1&b&&c=x%20y+z&d=&e=1&f=2", params, 4) == 4);
+  CHECK(params[0].key == "a" && params[0].value == "1");
+  CHECK(params[1].key == "b" && params[1].value.empty());
+  CHECK(params[2].key == "c" && params[2].value == "x%20y+z" && params[2].encoded_value);
+  CHECK(!params[2].encoded_key);
+  CHECK(params[3].key == "d" && params[3].value.empty());
+
+  CHECK(uri_parse_query("a+b=c=d", params, 4) == 1);
+  CHECK(params[0].encoded_key && params[0].value == "c=d");
+}
+
+static std::string decode(std::string_view str, bool plus_as_space)
+{
+  std::string out(str.size(), '\0');
+  out.resize(uri_decode(str, out.data(), plus_as_space));
+  return out;
+}
+
+static void test_decode()
+{
+  CHECK(decode("x%20y+z", true) == "x y z");
+  CHECK(decode("x%20y+z", false) == "x y+z");
+  CHECK(decode("%2F%2f", false) == "//");
+  // Malformed escapes are copied unchanged
+  CHECK(decode("%zz%4", true) == "%zz%4");
+  CHECK(decode("%", true) == "%");
+  CHECK(decode("%%41", true) == "%A");
+  CHECK(decode("%00", true) == std::string(1, '\0'));
+
+  // Decoding in place
+  char buf[] = "a%2e%2E";
+  CHECK(std::string_view(buf, uri_decode(buf, buf, false)) == "a..");
+
+  CHECK(uri_is_encoded("a+b", true));
+  CHECK(!uri_is_encoded("a+b", false));
+  CHECK(!uri_is_encoded("abc", true));
+}
+
+int main()
+{
+  test_wildcard_compatibility();
+  test_named_segments();
+  test_params_exhausted();
+  test_parse_query();
+  test_decode();
+  return check_failures;
+}
@@ -0,0 +1,669 @@
+/**
+ * @brief HTTP load generator for web_server.
+ *
+ * Opens a number of keep-alive connections that issue GET requests back to
+ * back, optionally alongside subscribers to a multipart stream, and reports
+ * throughput, latency percentiles, stream frame rates and byte rates as JSON.
+ * Results can be checked against a baseline file of thresholds, one per line:
+ *
+ *   # metric op value
+ *   rps >= 200
+ *   latency_p99_ms <= 50
+ *
+ * The exit status is 0 if every threshold passes, 1 if any fails and 2 if the
+ * run could not be performed.
+ */
+
+#include <algorithm>
+#include <arpa/inet.h>
+#include <atomic>
+#include <chrono>
+#include <errno.h>
+#include <fstream>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sstream>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <string>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+
+namespace
+{
+
+  using clock_type = std::chrono::steady_clock;
+
+  struct options_t
+  {
+    std::string host = "127.0.0.1";
+    std::string port = "8080";
+    std::vector<std::string> paths;
+    size_t connections = 16;
+    double duration = 10.0;
+    std::string stream_path;
+    size_t subscribers = 0;
+    std::string boundary = "FRAME";
+    std::string headers;
+    std::string baseline;
+    std::string output;
+  };
+
+  struct worker_result_t
+  {
+    std::vector<uint32_t> latencies_us;
+    uint64_t requests = 0;
+    uint64_t errors = 0;
+    uint64_t non_2xx = 0;
+    uint64_t connects = 0;
+    uint64_t bytes = 0;
+  };
+
+  struct subscriber_result_t
+  {
+    bool connected = false;
+    uint64_t frames = 0;
+    uint64_t bytes = 0;
+    double seconds = 0;
+  };
+
+  struct threshold_t
+  {
+    std::string metric;
+    std::string op;
+    double value;
+    double actual;
+    bool pass;
+  };
+
+  double seconds_since(clock_type::time_point start)
+  {
+    return std::chrono::duration<double>(clock_type::now() - start).count();
+  }
+
+  /**
+   * @brief A blocking HTTP/1.1 connection with a small read buffer.
+   */
+  class connection
+  {
+  public:
+    connection(const addrinfo *addr) : _addr(addr), _fd(-1), _pos(0) {}
+    ~connection() { close(); }
+
+    bool open()
+    {
+      close();
+      _fd = socket(_addr->ai_family, _addr->ai_socktype, _addr->ai_protocol);
+      if (_fd < 0)
+      {
+        return false;
+      }
+      timeval timeout = {1, 0};
+      setsockopt(_fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+      setsockopt(_fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+      int one = 1;
+      setsockopt(_fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+      if (connect(_fd, _addr->ai_addr, _addr->ai_addrlen) != 0)
+      {
+        close();
+        return false;
+      }
+      return true;
+    }
+
+    void close()
+    {
+      if (_fd >= 0)
+      {
+        ::close(_fd);
+        _fd = -1;
+      }
+      _buffer.clear();
+      _pos = 0;
+    }
+
+    bool is_open() const { return _fd >= 0; }
+
+    bool send_get(const std::string &host, const std::string &path, const std::string &headers)
+    {
+      std::string request = "GET " + path + " HTTP/1.1\r\nHost: " + host +
+                            "\r\nConnection: keep-alive\r\n" + headers + "\r\n";
+      size_t sent = 0;
+      while (sent < request.size())
+      {
+        ssize_t n = ::send(_fd, request.data() + sent, request.size() - sent, MSG_NOSIGNAL);
+        if (n <= 0)
+        {
+          return false;
+        }
+        sent += n;
+      }
+      return true;
+    }
+
+    /**
+     * @brief Reads a line without its CRLF. Retries on timeouts until deadline.
+     */
+    bool read_line(std::string &line, clock_type::time_point deadline)
+    {
+      while (true)
+      {
+        size_t end = _buffer.find("\r\n", _pos);
+        if (end != std::string::npos)
+        {
+          line.assign(_buffer, _pos, end - _pos);
+          _pos = end + 2;
+          return true;
+        }
+        if (!fill(deadline))
+        {
+          return false;
+        }
+      }
+    }
+
+    /**
+     * @brief Consumes size bytes, passing each contiguous piece to sink.
+     */
+    template <typename Sink>
+    bool read_body(size_t size, clock_type::time_point deadline, Sink sink)
+    {
+      while (size > 0)
+      {
+        if (_pos == _buffer.size() && !fill(deadline))
+        {
+          return false;
+        }
+        size_t n = std::min(size, _buffer.size() - _pos);
+        sink(_buffer.data() + _pos, n);
+        _pos += n;
+        size -= n;
+      }
+      return true;
+    }
+
+  private:
+    bool fill(clock_type::time_point deadline)
+    {
+      if (_pos == _buffer.size())
+      {
+        _buffer.clear();
+        _pos = 0;
+      }
+      char chunk[16384];
+      while (clock_type::now() < deadline)
+      {
+        ssize_t n = ::recv(_fd, chunk, sizeof(chunk), 0);
+        if (n > 0)
+        {
+          _buffer.append(chunk, n);
+          return true;
+        }
+        if (n == 0 || (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR))
+        {
+          return false;
+        }
+      }
+      return false;
+    }
+
+    const addrinfo *_addr;
+    int _fd;
+    std::string _buffer;
+    size_t _pos;
+  };
+
+  struct response_t
+  {
+    int status = 0;
+    bool keep_alive = true;
+    bool chunked = false;
+    bool has_length = false;
+    size_t content_length = 0;
+  };
+
+  bool read_headers(connection &conn, response_t &response, clock_type::time_point deadline)
+  {
+    std::string line;
+    if (!conn.read_line(line, deadline) || line.compare(0, 5, "HTTP/") != 0)
+    {
+      return false;
+    }
+    size_t space = line.find(' ');
+    response.status = (space == std::string::npos) ? 0 : atoi(line.c_str() + space + 1);
+    response.keep_alive = line.compare(0, 8, "HTTP/1.0") != 0;
+
+    while (conn.read_line(line, deadline))
+    {
+      if (line.empty())
+      {
+        return true;
+      }
+      size_t colon = line.find(':');
+      if (colon == std::string::npos)
+      {
+        continue;
+      }
+      size_t value_start = line.find_first_not_of(' ', colon + 1);
+      std::string field = line.substr(0, colon);
+      std::string value = (value_start == std::string::npos) ? "" : line.substr(value_start);
+      std::transform(field.begin(), field.end(), field.begin(), ::tolower);
+      std::transform(value.begin(), value.end(), value.begin(), ::tolower);
+      if (field == "content-length")
+      {
+        response.has_length = true;
+        response.content_length = strtoull(value.c_str(), nullptr, 10);
+      }
+      else if (field == "transfer-encoding" && value.find("chunked") != std::string::npos)
+      {
+        response.chunked = true;
+      }
+      else if (field == "connection")
+      {
+        response.keep_alive = value.find("close") == std::string::npos;
+      }
+    }
+    return false;
+  }
+
+  /**
+   * @brief Reads a response body, calling sink with each piece of decoded data.
+   */
+  template <typename Sink>
+  bool read_body(connection &conn, const response_t &response, clock_type::time_point deadline, Sink sink)
+  {
+    if (response.status == 204 || response.status == 304)
+    {
+      return true;
+    }
+    if (response.chunked)
+    {
+      std::string line;
+      while (true)
+      {
+        if (!conn.read_line(line, deadline))
+        {
+          return false;
+        }
+        size_t size = strtoull(line.c_str(), nullptr, 16);
+        if (size == 0)
+        {
+          // Skip any trailers
+          while (conn.read_line(line, deadline) && !line.empty())
+          {
+          }
+          return true;
+        }
+        if (!conn.read_body(size, deadline, sink) || !conn.read_line(line, deadline))
+        {
+          return false;
+        }
+      }
+    }
+    if (response.has_length)
+    {
+      return conn.read_body(response.content_length, deadline, sink);
+    }
+    // No framing, the body runs until the server closes the connection
+    conn.read_body(SIZE_MAX, deadline, sink);
+    return true;
+  }
+
+  void run_worker(const options_t &options, const addrinfo *addr, size_t index,
+                  clock_type::time_point end, worker_result_t &result)
+  {
+    connection conn(addr);
+    size_t next_path = index;
+    while (clock_type::now() < end)
+    {
+      if (!conn.is_open())
+      {
+        if (!conn.open())
+        {
+          result.errors++;
+          std::this_thread::sleep_for(std::chrono::milliseconds(10));
+          continue;
+        }
+        result.connects++;
+      }
+
+      const std::string &path = options.paths[next_path++ % options.paths.size()];
+      auto start = clock_type::now();
+      auto deadline = start + std::chrono::seconds(5);
+      response_t response;
+      uint64_t bytes = 0;
+      if (!conn.send_get(options.host, path, options.headers) ||
+          !read_headers(conn, response, deadline) ||
+          !read_body(conn, response, deadline, [&bytes](const char *, size_t n)
+                     { bytes += n; }))
+      {
+        result.errors++;
+        conn.close();
+        continue;
+      }
+
+      auto elapsed = std::chrono::duration_cast<std::chrono::microseconds>(clock_type::now() - start);
+      result.latencies_us.push_back((uint32_t)elapsed.count());
+      result.requests++;
+      result.bytes += bytes;
+      if (response.status < 200 || response.status > 399)
+      {
+        result.non_2xx++;
+      }
+      if (!response.keep_alive || (!response.chunked && !response.has_length))
+      {
+        conn.close();
+      }
+    }
+  }
+
+  void run_subscriber(const options_t &options, const addrinfo *addr,
+                      clock_type::time_point end, subscriber_result_t &result)
+  {
+    connection conn(addr);
+    response_t response;
+    if (!conn.open() ||
+        !conn.send_get(options.host, options.stream_path, options.headers) ||
+        !read_headers(conn, response, end) ||
+        response.status != 200)
+    {
+      return;
+    }
+    result.connected = true;
+
+    // Count part boundaries, carrying the tail of each piece over to the next
+    // so that boundaries split across reads are still found.
+    const std::string marker = "\r\n--" + options.boundary;
+    std::string window;
+    clock_type::time_point first_frame;
+    read_body(conn, response, end, [&](const char *data, size_t n)
+              {
+                result.bytes += n;
+                window.append(data, n);
+                size_t pos = 0;
+                while ((pos = window.find(marker, pos)) != std::string::npos)
+                {
+                  if (result.frames++ == 0)
+                  {
+                    first_frame = clock_type::now();
+                  }
+                  pos += marker.size();
+                }
+                if (window.size() >= marker.size())
+                {
+                  window.erase(0, window.size() - (marker.size() - 1));
+                }
+              });
+    if (result.frames > 1)
+    {
+      // Frame rate is measured between the first and last boundary seen
+      result.frames--;
+      result.seconds = seconds_since(first_frame);
+    }
+    else
+    {
+      result.frames = 0;
+    }
+  }
+
+  double percentile(const std::vector<uint32_t> &sorted, double p)
+  {
+    if (sorted.empty())
+    {
+      return 0;
+    }
+    size_t index = std::min(sorted.size() - 1, (size_t)(p / 100.0 * sorted.size()));
+    return sorted[index] / 1000.0;
+  }
+
+  bool load_baseline(const std::string &path, std::vector<threshold_t> &thresholds)
+  {
+    std::ifstream file(path);
+    if (!file)
+    {
+      return false;
+    }
+    std::string line;
+    while (std::getline(file, line))
+    {
+      line = line.substr(0, line.find('#'));
+      std::istringstream fields(line);
+      threshold_t threshold = {};
+      if (!(fields >> threshold.metric))
+      {
+        continue;
+      }
+      if (!(fields >> threshold.op >> threshold.value) || (threshold.op != ">=" && threshold.op != "<="))
+      {
+        fprintf(stderr, "Invalid baseline line: %s\n", line.c_str());
+        return false;
+      }
+      thresholds.push_back(threshold);
+    }
+    return true;
+  }
+
+  void usage(const char *argv0)
+  {
+    fprintf(stderr,
+            "Usage: %s [options]\n"
+            "  --host HOST          Server address (default 127.0.0.1)\n"
+            "  --port PORT          Server port (default 8080)\n"
+            "  --path PATH          Path to request, may be repeated (default /)\n"
+            "  --connections N      Keep-alive connections issuing requests (default 16)\n"
+            "  --duration SECONDS   Length of the run (default 10)\n"
+            "  --stream-path PATH   Multipart stream to subscribe to\n"
+            "  --subscribers N      Concurrent stream subscribers (default 0)\n"
+            "  --boundary NAME      Multipart boundary (default FRAME)\n"
+            "  --header LINE        Extra request header, may be repeated\n"
+            "  --baseline FILE      Thresholds to check the results against\n"
+            "  --output FILE        Write the JSON results to FILE instead of stdout\n",
+            argv0);
+  }
+
+  bool parse_options(int argc, char **argv, options_t &options)
+  {
+    for (int i = 1; i < argc; i++)
+    {
+      std::string arg = argv[i];
+      if (i + 1 >= argc)
+      {
+        return false;
+      }
+      std::string value = argv[++i];
+      if (arg == "--host")
+        options.host = value;
+      else if (arg == "--port")
+        options.port = value;
+      else if (arg == "--path")
+        options.paths.push_back(value);
+      else if (arg == "--connections")
+        options.connections = strtoul(value.c_str(), nullptr, 10);
+      else if (arg == "--duration")
+        options.duration = strtod(value.c_str(), nullptr);
+      else if (arg == "--stream-path")
+        options.stream_path = value;
+      else if (arg == "--subscribers")
+        options.subscribers = strtoul(value.c_str(), nullptr, 10);
+      else if (arg == "--boundary")
+        options.boundary = value;
+      else if (arg == "--header")
+        options.headers += value + "\r\n";
+      else if (arg == "--baseline")
+        options.baseline = value;
+      else if (arg == "--output")
+        options.output = value;
+      else
+        return false;
+    }
+    if (options.paths.empty() && options.connections)
+    {
+      options.paths.push_back("/");
+    }
+    if (options.subscribers && options.stream_path.empty())
+    {
+      return false;
+    }
+    return options.duration > 0;
+  }
+
+} // namespace
+
+int main(int argc, char **argv)
+{
+  options_t options;
+  if (!parse_options(argc, argv, options))
+  {
+    usage(argv[0]);
+    return 2;
+  }
+
+  std::vector<threshold_t> thresholds;
+  if (!options.baseline.empty() && !load_baseline(options.baseline, thresholds))
+  {
+    fprintf(stderr, "Failed to load baseline %s\n", options.baseline.c_str());
+    return 2;
+  }
+
+  addrinfo hints = {};
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_socktype = SOCK_STREAM;
+  addrinfo *addr = nullptr;
+  int gai = getaddrinfo(options.host.c_str(), options.port.c_str(), &hints, &addr);
+  if (gai != 0)
+  {
+    fprintf(stderr, "Failed to resolve %s: %s\n", options.host.c_str(), gai_strerror(gai));
+    return 2;
+  }
+
+  std::vector<worker_result_t> workers(options.connections);
+  std::vector<subscriber_result_t> subscribers(options.subscribers);
+  std::vector<std::thread> threads;
+
+  auto start = clock_type::now();
+  auto end = start + std::chrono::duration_cast<clock_type::duration>(std::chrono::duration<double>(options.duration));
+  for (size_t i = 0; i < subscribers.size(); i++)
+  {
+    threads.emplace_back(run_subscriber, std::cref(options), addr, end, std::ref(subscribers[i]));
+  }
+  for (size_t i = 0; i < workers.size(); i++)
+  {
+    threads.emplace_back(run_worker, std::cref(options), addr, i, end, std::ref(workers[i]));
+  }
+  for (auto &thread : threads)
+  {
+    thread.join();
+  }
+  double elapsed = seconds_since(start);
+  freeaddrinfo(addr);
+
+  worker_result_t total;
+  for (auto &worker : workers)
+  {
+    total.requests += worker.requests;
+    total.errors += worker.errors;
+    total.non_2xx += worker.non_2xx;
+    total.connects += worker.connects;
+    total.bytes += worker.bytes;
+    total.latencies_us.insert(total.latencies_us.end(), worker.latencies_us.begin(), worker.latencies_us.end());
+  }
+  std::sort(total.latencies_us.begin(), total.latencies_us.end());
+  double latency_sum = 0;
+  for (auto latency : total.latencies_us)
+  {
+    latency_sum += latency / 1000.0;
+  }
+
+  size_t connected = 0;
+  uint64_t stream_bytes = 0;
+  double fps_min = 0;
+  double fps_sum = 0;
+  for (auto &subscriber : subscribers)
+  {
+    stream_bytes += subscriber.bytes;
+    if (!subscriber.connected)
+    {
+      continue;
+    }
+    double fps = subscriber.seconds > 0 ? subscriber.frames / subscriber.seconds : 0;
+    fps_min = (connected == 0) ? fps : std::min(fps_min, fps);
+    fps_sum += fps;
+    connected++;
+  }
+
+  struct metric_t
+  {
+    const char *name;
+    double value;
+  };
+  const uint64_t attempts = total.requests + total.errors;
+  const metric_t metrics[] = {
+      {"requests", (double)total.requests},
+      {"errors", (double)total.errors},
+      {"error_rate", attempts ? (double)(total.errors + total.non_2xx) / attempts : 0},
+      {"non_2xx", (double)total.non_2xx},
+      {"connects", (double)total.connects},
+      {"requests_per_connection", total.connects ? (double)total.requests / total.connects : 0},
+      {"rps", total.requests / elapsed},
+      {"bytes_per_sec", total.bytes / elapsed},
+      {"latency_min_ms", percentile(total.latencies_us, 0)},
+      {"latency_mean_ms", total.requests ? latency_sum / total.requests : 0},
+      {"latency_p50_ms", percentile(total.latencies_us, 50)},
+      {"latency_p90_ms", percentile(total.latencies_us, 90)},
+      {"latency_p99_ms", percentile(total.latencies_us, 99)},
+      {"latency_max_ms", total.latencies_us.empty() ? 0 : total.latencies_us.back() / 1000.0},
+      {"stream_subscribers", (double)subscribers.size()},
+      {"stream_connected", (double)connected},
+      {"stream_fps_min", fps_min},
+      {"stream_fps_mean", connected ? fps_sum / connected : 0},
+      {"stream_bytes_per_sec", stream_bytes / elapsed},
+  };
+
+  bool pass = true;
+  for (auto &threshold : thresholds)
+  {
+    auto metric = std::find_if(std::begin(metrics), std::end(metrics), [&](const metric_t &m)
+                               { return threshold.metric == m.name; });
+    if (metric == std::end(metrics))
+    {
+      fprintf(stderr, "Unknown baseline metric: %s\n", threshold.metric.c_str());
+      return 2;
+    }
+    threshold.actual = metric->value;
+    threshold.pass = (threshold.op == ">=") ? metric->value >= threshold.value : metric->value <= threshold.value;
+    pass = pass && threshold.pass;
+  }
+
+  FILE *out = options.output.empty() ? stdout : fopen(options.output.c_str(), "w");
+  if (!out)
+  {
+    fprintf(stderr, "Failed to open %s\n", options.output.c_str());
+    return 2;
+  }
+  fprintf(out, "{\n  \"duration_s\": %.3f,\n  \"connections\": %zu,\n  \"metrics\": {\n", elapsed, options.connections);
+  for (size_t i = 0; i < std::size(metrics); i++)
+  {
+    fprintf(out, "    \"%s\": %.3f%s\n", metrics[i].name, metrics[i].value, i + 1 < std::size(metrics) ? "," : "");
+  }
+  fprintf(out, "  },\n  \"thresholds\": [");
+  for (size_t i = 0; i < thresholds.size(); i++)
+  {
+    auto &threshold = thresholds[i];
+    fprintf(out, "%s\n    {\"metric\": \"%s\", \"op\": \"%s\", \"value\": %.3f, \"actual\": %.3f, \"pass\": %s}",
+            i ? "," : "", threshold.metric.c_str(), threshold.op.c_str(), threshold.value, threshold.actual,
+            threshold.pass ? "true" : "false");
+  }
+  fprintf(out, "%s],\n  \"pass\": %s\n}\n", thresholds.empty() ? "" : "\n  ", pass ? "true" : "false");
+  if (out != stdout)
+  {
+    fclose(out);
+  }
+
+  return pass ? 0 : 1;
+}